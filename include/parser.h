@@ -5,6 +5,16 @@ typedef struct {
 	char ** argv;
 } tcommand;
 
+typedef enum { REDIRECT_READ, REDIRECT_WRITE, REDIRECT_APPEND, REDIRECT_DUP, REDIRECT_CLOSE } tredirect_type;
+
+typedef struct {
+	int command;
+	int fd;
+	tredirect_type type;
+	char * filename;
+	int source_fd;
+} tredirect;
+
 typedef struct {
 	int ncommands;
 	tcommand * commands;
@@ -12,6 +22,10 @@ typedef struct {
 	char * redirect_output;
 	char * redirect_error;
 	int background;
+	int nredirects;
+	tredirect * redirects;
+	int nconsumers;
+	int * consumers;
 } tline;
 
 extern tline * tokenize(char *str);
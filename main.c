@@ -1,345 +1,6599 @@
+#define _GNU_SOURCE
+
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <ucontext.h>
+#include <linux/perf_event.h>
+#ifdef MSH_SOAK
+#include <malloc.h>
+#endif
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 #include "include/parser.h"
 
 #define BUFSIZE 1024
+#define RING_SIZE (64 * 1024) // bytes of captured output kept in memory per job
+#define MAX_DONE_JOBS 8 // finished jobs whose output is kept until read with `output`
+#define TIMEOUT_GRACE 5 // seconds between SIGTERM and SIGKILL when a job times out
+#define TIMEOUT_STATUS 124 // exit status of a job that timed out
 
-typedef struct Job {
-	int id;
-	char *command;
-	pid_t *pids;
-	int stopped; // 1 stopped (true) | 0 running (false)
-	int num_pids;
-} Job;
+/*
+ * Shell options, toggled with set -o name / set +o name
+ *
+ * capture: background jobs write stdout/stderr into a ring buffer instead of the terminal
+ * spill: captured output that does not fit in the ring buffer is moved to a temp file instead of dropped
+ * zygote: commands are spawned by the zygote process instead of forking the shell
+ * placement: stages of a pipeline are pinned to CPUs sharing a cache
+ * fdaudit: after starting a pipeline, fds the shell leaked or would pass on to children are reported
+ * pipefail: a pipeline's status is the one of its rightmost failed stage, not just the last one's
+ * failfast: once a stage fails, the stages still running in its pipeline get SIGTERM
+ * perf: every stage gets perf_event_open counters, shown by jobs -l
+ */
 
-Job *jobs;
-int job_count = 0;
+enum { OPT_CAPTURE, OPT_SPILL, OPT_ZYGOTE, OPT_PLACEMENT, OPT_FDAUDIT, OPT_PIPEFAIL, OPT_FAILFAST, OPT_PERF, OPT_COUNT };
 
-void add_job(char* command) {
+const char *option_names[OPT_COUNT] = {
+	"capture", "spill", "zygote", "placement", "fdaudit", "pipefail", "failfast", "perf"
+};
+int options[OPT_COUNT] = { 0 };
 
-	command[strlen(command) - 1] = '\0';
-	const tline *line = tokenize(command);
+/*
+ * Arena allocator for everything that lives as long as one input line (the parsed tree and its tlines).
+ * arena_reset() keeps the first chunk so a steady stream of short lines doesn't touch malloc.
+ */
 
-	jobs[job_count].id = job_count;
-	jobs[job_count].pids = malloc(sizeof(pid_t) * line->ncommands);
-	jobs[job_count].command = strdup(command);
-	jobs[job_count].stopped = 0;
-	jobs[job_count].num_pids = line->ncommands;
+#define ARENA_CHUNK (16 * 1024)
 
-	job_count++;
-}
+typedef struct ArenaChunk {
+	struct ArenaChunk *next;
+	size_t used;
+	size_t size;
+	char data[];
+} ArenaChunk;
 
-void delete_job(const int job_id) {
-	for (int i = 0; i < job_count; i++) {
-		if (jobs[i].id == job_id) {
-			free(jobs[i].pids);
-			free(jobs[i].command);
-			for (int j = i; j < job_count - 1; j++) {
-				jobs[j] = jobs[j + 1];
-			}
+typedef struct Arena {
+	ArenaChunk *head;
+	ArenaChunk *spare; // last chunk released, reused before calling malloc again
+} Arena;
 
-			job_count--;
-			if (job_count == 0) {
-				jobs = malloc(sizeof(Job));
-			} else {
-				jobs = realloc(jobs, sizeof(Job) * (job_count));
-			}
-			printf("Deleted job [%d]\n", job_id);
-			return;
+typedef struct ArenaMark {
+	ArenaChunk *chunk;
+	size_t used;
+} ArenaMark;
+
+void *arena_alloc(Arena *arena, size_t size) {
+	size = (size + 15) & ~(size_t) 15;
+
+	if (arena->head == NULL || arena->head->used + size > arena->head->size) {
+		ArenaChunk *chunk = arena->spare;
+		if (chunk != NULL && chunk->size >= size) {
+			arena->spare = NULL;
+		} else {
+			const size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+			chunk = malloc(sizeof(ArenaChunk) + chunk_size);
+			chunk->size = chunk_size;
 		}
+		chunk->next = arena->head;
+		chunk->used = 0;
+		arena->head = chunk;
 	}
-	fprintf(stderr, "Job ID %d not found\n", job_id);
+
+	void *ptr = arena->head->data + arena->head->used;
+	arena->head->used += size;
+	return ptr;
 }
 
-Job *_get_job(int id) {
-	for (int i = 0; i < job_count; i++) {
-		if (jobs[i].id == id) {
-			return &jobs[i];
-		}
-	}
-	return NULL;
+char *arena_strndup(Arena *arena, const char *str, const size_t len) {
+	char *dup = arena_alloc(arena, len + 1);
+	memcpy(dup, str, len);
+	dup[len] = '\0';
+	return dup;
 }
 
-void sigchld_handler(int sig) {
-	pid_t pid;
-	int status;
+char *arena_strdup(Arena *arena, const char *str) {
+	return str == NULL ? NULL : arena_strndup(arena, str, strlen(str));
+}
 
-	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-		for (int i = 0; i < job_count; i++) {
-			for (int j = 0; j < jobs[i].num_pids; j++) {
-				if (pid == jobs[i].pids[j]) {
+/*
+ * arena_mark()/arena_release() free everything allocated in between, like a stack
+ */
 
-					if (WIFEXITED(status)) {
-						printf("\nJob [%d] (%s) finished with status %d\n", jobs[i].id, jobs[i].command, WEXITSTATUS(status));
-					} else if (WIFSIGNALED(status)) {
-						printf("\nJob [%d] terminated with signal %d\n", jobs[i].id, WTERMSIG(status));
-					}
-					jobs[i].stopped = 1;
-					delete_job(jobs[i].id);
-					break;
-				}
-			}
-		}
+ArenaMark arena_mark(const Arena *arena) {
+	const ArenaMark mark = { arena->head, arena->head == NULL ? 0 : arena->head->used };
+	return mark;
+}
+
+void arena_release(Arena *arena, const ArenaMark mark) {
+	while (arena->head != mark.chunk) {
+		ArenaChunk *next = arena->head->next;
+		if (arena->spare == NULL) arena->spare = arena->head;
+		else free(arena->head);
+		arena->head = next;
 	}
+	if (arena->head != NULL) arena->head->used = mark.used;
 }
 
-void print_jobs() {
-	if (job_count <= 0) {
-		printf("%s", "There are no jobs.\n");
-	} else {
-		char *running = "Stopped";
-		for (int i = 0; i < job_count; i++) {
-			if (!jobs[i].stopped) running = "Running";
-			printf("[%d] %s \t\t%s\n", jobs[i].id, running, jobs[i].command);
-		}
+void arena_reset(Arena *arena) {
+	if (arena->head == NULL) return;
+
+	while (arena->head->next != NULL) {
+		ArenaChunk *next = arena->head->next;
+		free(arena->head);
+		arena->head = next;
 	}
+	arena->head->used = 0;
 }
 
-void fg(const int job_id) {
-	signal(SIGINT, SIG_DFL);
-	signal(SIGQUIT, SIG_DFL);
+/*
+ * Shell variables
+ *
+ * Names are interned: the table holds one Symbol per distinct name and the variable lives in it,
+ * so looking up $NAME while expanding is a hash of the bytes in the word, with no copy.
+ * Exported variables are also kept as an envp array for execve, rebuilt only after one of them changes.
+ */
 
-	Job *job = _get_job(job_id);
+typedef struct Symbol {
+	char *name;
+	size_t len;
+	unsigned int hash;
+	char *value; // NULL while unset
+	size_t value_cap;
+	int exported;
+} Symbol;
 
-	if (job != NULL) {
-		if (!job->stopped) {
-			for (int j = 0; j < job->num_pids; j++) {
-				int status;
-				waitpid(job->pids[j], &status, WUNTRACED);
+Symbol **symbols = NULL;
+size_t symbol_cap = 0;
+size_t symbol_count = 0;
+
+char **envp_cache = NULL;
+int envp_dirty = 1;
+
+unsigned int _hash(const char *str, const size_t len) {
+	unsigned int hash = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Returns the symbol for name[0..len), creating it if create is set (NULL otherwise)
+ */
+
+Symbol *intern(const char *name, const size_t len, const int create) {
+	const unsigned int hash = _hash(name, len);
+
+	if (symbol_cap > 0) {
+		for (size_t i = hash & (symbol_cap - 1); symbols[i] != NULL; i = (i + 1) & (symbol_cap - 1)) {
+			if (symbols[i]->hash == hash && symbols[i]->len == len && !memcmp(symbols[i]->name, name, len)) {
+				return symbols[i];
 			}
-			job->stopped = 1;
-		} else {
-			printf("Job [%d] is not running.\n", job_id);
 		}
+	}
+	if (!create) return NULL;
 
-	} else {
-		fprintf(stderr, "\nInvalid job ID %d", job_id);
+	if ((symbol_count + 1) * 2 > symbol_cap) { // keep the load under 1/2
+		const size_t old_cap = symbol_cap;
+		Symbol **old = symbols;
+		symbol_cap = old_cap == 0 ? 64 : old_cap * 2;
+		symbols = calloc(symbol_cap, sizeof(Symbol *));
+		for (size_t j = 0; j < old_cap; j++) {
+			if (old[j] == NULL) continue;
+			size_t i = old[j]->hash & (symbol_cap - 1);
+			while (symbols[i] != NULL) i = (i + 1) & (symbol_cap - 1);
+			symbols[i] = old[j];
+		}
+		free(old);
 	}
 
+	Symbol *sym = calloc(1, sizeof(Symbol));
+	sym->name = strndup(name, len);
+	sym->len = len;
+	sym->hash = hash;
+
+	size_t i = hash & (symbol_cap - 1);
+	while (symbols[i] != NULL) i = (i + 1) & (symbol_cap - 1);
+	symbols[i] = sym;
+	symbol_count++;
+	return sym;
+}
+
+const char *var_get(const char *name) {
+	const Symbol *sym = intern(name, strlen(name), 0);
+	return sym == NULL ? NULL : sym->value;
+}
+
+void var_set(const char *name, const size_t len, const char *value, const int export) {
+	Symbol *sym = intern(name, len, 1);
 
+	if (value != NULL) {
+		const size_t value_len = strlen(value);
+		if (value_len + 1 > sym->value_cap) { // the buffer is reused, a loop variable doesn't allocate every iteration
+			sym->value_cap = value_len + 1 > 32 ? value_len + 1 : 32;
+			free(sym->value);
+			sym->value = malloc(sym->value_cap);
+		}
+		memcpy(sym->value, value, value_len + 1);
+	}
+	if (export) sym->exported = 1;
+	if (sym->exported) envp_dirty = 1;
 }
 
+void var_unset(const char *name) {
+	Symbol *sym = intern(name, strlen(name), 0);
+	if (sym == NULL) return;
+
+	if (sym->exported) envp_dirty = 1;
+	free(sym->value);
+	sym->value = NULL;
+	sym->value_cap = 0;
+	sym->exported = 0;
+}
 
 /*
- * Creates a child process to execute a command via execvp
- * We don't take as a parameter line->command because of the needed use of redirection info
- *
+ * NULL terminated NAME=value array of the exported variables
  */
 
-void execute_pipeline(const tline * line, char *cmd) {
-	pid_t *pids = malloc(sizeof(pid_t) * line->ncommands);
-	int in_fd = 0;
+char **shell_envp(void) {
+	if (!envp_dirty) return envp_cache;
 
-	for (int j = 0; j < line->ncommands; j++) {
-		if (line->commands[j].filename == NULL) {
-			fprintf(stderr, "%s: No se encuentra el mandato.\n", line->commands[j].argv[0]);
-			return;
-		}
+	if (envp_cache != NULL) {
+		for (int i = 0; envp_cache[i] != NULL; i++) free(envp_cache[i]);
+		free(envp_cache);
 	}
 
-	if (line->background) {
+	size_t n = 0;
+	envp_cache = malloc(sizeof(char *) * (symbol_count + 1));
+	for (size_t i = 0; i < symbol_cap; i++) {
+		const Symbol *sym = symbols[i];
+		if (sym == NULL || !sym->exported || sym->value == NULL) continue;
 
-		if (job_count == 0) {
-			jobs = malloc(sizeof(Job));
-		} else {
-			jobs = realloc(jobs, sizeof(Job) * (job_count + 1));
-		}
-		add_job(cmd);
+		char *entry = malloc(sym->len + strlen(sym->value) + 2);
+		memcpy(entry, sym->name, sym->len);
+		entry[sym->len] = '=';
+		strcpy(entry + sym->len + 1, sym->value);
+		envp_cache[n++] = entry;
 	}
-	for (int i = 0; i < line->ncommands; i++) {
+	envp_cache[n] = NULL;
+	envp_dirty = 0;
+	return envp_cache;
+}
 
-		int pipefd[2];
-		pipe(pipefd);
+void import_environ(char **envp) {
+	for (int i = 0; envp[i] != NULL; i++) {
+		const char *eq = strchr(envp[i], '=');
+		if (eq != NULL) var_set(envp[i], eq - envp[i], eq + 1, 1);
+	}
+}
 
-		const pid_t pid = fork();
+int _is_name_char(const char c, const int first) {
+	return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (!first && c >= '0' && c <= '9');
+}
 
-		if (pid == -1) { perror("fork"); exit(1); }
-		if (pid == 0) { // Child
-			signal(SIGINT, SIG_DFL);
-			signal(SIGQUIT, SIG_DFL);
+/*
+ * Length of the NAME in a NAME=value word, 0 if it isn't an assignment
+ */
 
-			/*
-			 * pipefd[0] -> Read end
-			 * pipefd[1] -> Write end
-			 */
+size_t assignment_name_len(const char *word) {
+	size_t len = 0;
+	while (_is_name_char(word[len], len == 0)) len++;
+	return len > 0 && word[len] == '=' ? len : 0;
+}
 
-			if ( i != line->ncommands-1) { // Si no es el ultimo sustituimos stdout por el write end
-				dup2(pipefd[1], STDOUT_FILENO);
-				close(pipefd[1]);
-				close(pipefd[0]);
-			}
+/*
+ * Fixed size circular buffer for the output of a background job.
+ * When it gets full the oldest bytes are dropped, or written to spill_fd if the spill option is set,
+ * so the memory used per job never grows past RING_SIZE.
+ */
 
+typedef struct Ring {
+	char *data;
+	size_t head; // index of the oldest byte
+	size_t len;
+	size_t dropped;
+	int spill_fd;
+	size_t spilled;
+} Ring;
 
+/*
+ * Fan-out state of a producer |& { consumer, ... } job, see fanout_pump()
+ */
 
-			if ( i != 0 ) { // si no es el primero sustituimos stdin por el read end del anterior
-				dup2(in_fd, STDIN_FILENO);
-				close(in_fd);
-			}
+typedef struct Consumer {
+	int fd; // write end of the pipe of its first stage, -1 once it's closed
+	int stash[2]; // private pipe with what it hasn't taken yet of the current chunk
+	size_t pending; // bytes in the stash
+	unsigned long long bytes; // delivered
+	unsigned long long full; // times its pipe filled up with bytes pending
+	double held; // seconds it was the only one the producer was waiting for
+	double alone_since; // when it became that one, 0 if it isn't
+} Consumer;
 
+typedef struct Fanout {
+	int fd; // read end of the producer's pipe, -1 once it's closed
+	int count;
+	Consumer *consumers;
+	unsigned long long chunks;
+} Fanout;
 
-			// if it has a redirect input filename we redirect STDIN into the fd of the provided file
-			if (line->redirect_input != NULL && i == 0) {
-				const int input_fd = open(line->redirect_input, O_RDONLY);
-				if (input_fd == -1) {
-					fprintf(stderr, "%s: Error. ", line->redirect_input);
-					perror("open");
-					exit(1);
-				}
-				dup2(input_fd, STDIN_FILENO); // Sustituye la entrada de STDIN (0) por input_fd
-				close(input_fd); // Cierra input_fd (original)
-			}
-			// if it has a redirect output filename we redirect STDOUT into the fd of the new file
-			if (line->redirect_output != NULL && i == line->ncommands - 1) {
-				const int out_fd = open(line->redirect_output, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-				dup2(out_fd, STDOUT_FILENO);
-				close(out_fd);
-			}
-			// if it has a redirect error filename we redirect STDERR into the fd of the new file
-			if (line->redirect_error != NULL && i == line->ncommands - 1) {
-				const int err_fd = open(line->redirect_error, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-				dup2(err_fd, STDERR_FILENO);
-				close(err_fd);
-			}
-			execvp(line->commands[i].argv[0], line->commands[i].argv);
-			fprintf(stderr, "Something went wrong!\n");
-		}
-		// Parent
+/*
+ * perf_event_open counters of a stage (set -o perf, time -v), see counters_open()
+ */
 
-		if (i < line->ncommands - 1 ) {
-			close(pipefd[1]);
-		}
-		if (i != 0) {
-			close(in_fd);
+#define PERF_COUNTERS 6
 
-		}
-		in_fd = pipefd[0];
+typedef struct Counters {
+	int fds[PERF_COUNTERS]; // -1 for the ones the kernel didn't allow, and once they're read
+	unsigned int opened; // bit i set if counter i was opened
+	unsigned long long values[PERF_COUNTERS];
+	double started;
+	double ended; // 0 while it runs
+} Counters;
+
+typedef struct Job {
+	int id;
+	char *command;
+	pid_t *pids;
+	int *cpus; // cpu each pid is pinned to, -1 if it isn't
+	pid_t pgid; // process group of the job with job control, 0 without it
+	int stopped; // pids stopped by a signal, the job is stopped when all the running ones are
+	int stop_signal;
+	int num_pids;
+	int running; // pids not reaped yet
+	int *statuses; // waitpid status of each pid, STAGE_RUNNING or STAGE_STOPPED until it's reaped
+	int foreground;
+	int done; // 1 when every pid has been reaped and its output fully read
+	int capture_fd; // read end of the capture pipe, -1 if output is not captured
+	int timer_fd; // timerfd armed with the job's deadline, -1 if it has none
+	int timed_out; // 1 once it got SIGTERM for passing its deadline, 2 after SIGKILL
+	Fanout *fanout; // NULL if it isn't a fan-out
+	Counters *counters; // of each stage, NULL without set -o perf
+	Ring output;
+} Job;
+
+#define STAGE_RUNNING -1
+#define STAGE_STOPPED -2
+
+Job *jobs;
+int job_count = 0;
+Fanout *last_fanout = NULL; // of the last fan-out job removed, for the statistics time prints
+int job_control = 0; // interactive shell: every pipeline gets its own process group and the terminal
+pid_t shell_pgid = 0;
+int last_status = 0; // exit status of the last pipeline
+int interrupted = 0; // a foreground job was killed by SIGINT, the rest of the line is skipped
+
+int sigchld_pipe[2] = { -1, -1 };
+int prompt_pipe[2] = { -1, -1 }; // the prompt worker writes to it when it finds a new branch
+void prompt_repaint(void);
+pid_t zygote_pid = -1; // reaped with the other children, see zygote_lost()
+void zygote_lost(void);
+
+typedef struct Script Script; // msh -j, defined with the scheduler at the end
+
+Script *current_script = NULL; // script whose state is in the globals, NULL for the interactive shell
+int script_yield(const int wait_fd);
+void script_exit(void);
+void script_child_status(const pid_t pid, const int status);
+
+void ring_init(Ring *ring) {
+	ring->data = NULL;
+	ring->head = 0;
+	ring->len = 0;
+	ring->dropped = 0;
+	ring->spill_fd = -1;
+	ring->spilled = 0;
+}
+
+void ring_free(Ring *ring) {
+	free(ring->data);
+	if (ring->spill_fd != -1) close(ring->spill_fd);
+	ring_init(ring);
+}
+
+/*
+ * Moves the n oldest bytes out of the ring, into the spill file if there is one
+ */
 
-		if (line->background) {
-			Job *curr = _get_job(job_count - 1);
-			curr->pids[i] = pid;
+void _ring_evict(Ring *ring, size_t n) {
+	if (options[OPT_SPILL] && ring->spill_fd == -1) {
+		char template[] = "/tmp/msh-output-XXXXXX";
+		ring->spill_fd = mkostemp(template, O_CLOEXEC);
+		if (ring->spill_fd != -1) unlink(template); // the fd keeps the file alive until the job is deleted
+	}
+
+	while (n > 0) {
+		size_t chunk = RING_SIZE - ring->head;
+		if (chunk > n) chunk = n;
+
+		if (ring->spill_fd != -1 && write(ring->spill_fd, ring->data + ring->head, chunk) == (ssize_t) chunk) {
+			ring->spilled += chunk;
 		} else {
-			pids[i] = pid;
+			ring->dropped += chunk;
 		}
+		ring->head = (ring->head + chunk) % RING_SIZE;
+		ring->len -= chunk;
+		n -= chunk;
+	}
+}
+
+/*
+ * Appends n bytes (n <= RING_SIZE) evicting the oldest ones if needed
+ */
+
+void ring_write(Ring *ring, const char *buf, const size_t n) {
+	if (ring->data == NULL) {
+		ring->data = malloc(RING_SIZE);
+	}
+	if (ring->len + n > RING_SIZE) {
+		_ring_evict(ring, ring->len + n - RING_SIZE);
 	}
 
-	if (!line->background) {
-		for (int i = 0; i < line->ncommands; i++) {
-			waitpid(pids[i], NULL, 0);
+	const size_t tail = (ring->head + ring->len) % RING_SIZE;
+	size_t first = RING_SIZE - tail;
+	if (first > n) first = n;
+	memcpy(ring->data + tail, buf, first);
+	memcpy(ring->data, buf + first, n - first);
+	ring->len += n;
+}
+
+/*
+ * Writes everything captured (spill file first, then the ring) into fd
+ */
+
+void ring_dump(const Ring *ring, int fd) {
+	char buf[BUFSIZE * 4];
+
+	if (ring->dropped > 0) {
+		dprintf(fd, "[... %zu bytes dropped ...]\n", ring->dropped);
+	}
+	if (ring->spill_fd != -1) {
+		off_t off = 0;
+		ssize_t n;
+		while ((n = pread(ring->spill_fd, buf, sizeof(buf), off)) > 0) {
+			if (write(fd, buf, n) != n) return;
+			off += n;
 		}
 	}
+	if (ring->len > 0) {
+		size_t first = RING_SIZE - ring->head;
+		if (first > ring->len) first = ring->len;
+		if (write(fd, ring->data + ring->head, first) != (ssize_t) first) return;
+		if (write(fd, ring->data, ring->len - first) != (ssize_t) (ring->len - first)) return;
+	}
+}
 
+/*
+ * Fan-out
+ *
+ * In producer |& { consumer, ... } the producer writes into a pipe read by the shell, and the first stage
+ * of each consumer reads from a pipe the shell writes. The bytes never come up to userspace: every chunk
+ * the producer wrote is duplicated with tee() into a private stash pipe per consumer (the last one gets it
+ * with splice(), which consumes it), and each stash is spliced into its consumer as that pipe has room.
+ * The stashes are as big as the producer's pipe and empty when a chunk is taken, so tee() always copies
+ * all of it. The next chunk waits until every consumer has taken the current one: like with tee(1),
+ * the slowest consumer holds the producer back, and Consumer.held says for how long.
+ * The pump runs from the event loop, which polls the fds fanout_poll() asks for.
+ */
 
-	free(pids);
+double _now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
+void _close_consumer(Consumer *consumer) {
+	if (consumer->fd != -1) close(consumer->fd);
+	if (consumer->stash[0] != -1) { close(consumer->stash[0]); close(consumer->stash[1]); }
+	consumer->fd = consumer->stash[0] = consumer->stash[1] = -1;
+	consumer->pending = 0;
+	consumer->alone_since = 0;
+}
 
 /*
- * Definition of cd shell builtin
- *
- * arg: parser.h tline object
- * if the path provided is null, target_dir is the one inside HOME env variable
- * converts ~ into user's home directory
- *
+ * Closes every pipe of the fan-out, its statistics stay
  */
 
-void cd(const tline *line) {
-	char *home_dir = getenv("HOME");
-	char *target_dir = NULL;
+void fanout_close(Fanout *fanout) {
+	if (fanout->fd != -1) close(fanout->fd);
+	fanout->fd = -1;
+	for (int i = 0; i < fanout->count; i++) _close_consumer(&fanout->consumers[i]);
+}
 
+void fanout_free(Fanout *fanout) {
+	fanout_close(fanout);
+	free(fanout->consumers);
+	free(fanout);
+}
 
-	if (home_dir == NULL) {
-		fprintf(stderr, "cd: $HOME not found.\n");
-		return;
+/*
+ * Creates the pipes of a fan-out to count consumers. The ends for the children are stored in ends:
+ * ends[0] for the producer's stdout, ends[i + 1] for the stdin of consumer i. Returns NULL if it failed.
+ */
+
+Fanout *fanout_open(const int count, int *ends) {
+	Fanout *fanout = malloc(sizeof(Fanout));
+	int feed[2];
+
+	fanout->count = count;
+	fanout->consumers = calloc(count, sizeof(Consumer));
+	fanout->chunks = 0;
+	for (int i = 0; i < count; i++) {
+		fanout->consumers[i].fd = fanout->consumers[i].stash[0] = fanout->consumers[i].stash[1] = -1;
+	}
+	if (pipe2(feed, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe2");
+		fanout->fd = -1;
+		fanout_free(fanout);
+		return NULL;
 	}
+	fanout->fd = feed[0];
+	ends[0] = feed[1];
+	fcntl(feed[1], F_SETFL, 0); // the producer gets a blocking pipe
 
-	if (line->commands[0].argv[1] == NULL) {
-		target_dir = home_dir;
-	} else if (line->commands[0].argv[1][0] == '~') {
-		const size_t path_len = strlen(home_dir) + strlen(line->commands[0].argv[1]);
-		target_dir = malloc(path_len + 1);
-		snprintf(target_dir, path_len, "%s%s", home_dir, line->commands[0].argv[1]+1);
+	const int size = fcntl(feed[0], F_GETPIPE_SZ);
+	for (int i = 0; i < count; i++) {
+		Consumer *consumer = &fanout->consumers[i];
+		int pipe[2];
 
-	} else {
-		target_dir = line->commands[0].argv[1];
+		if (pipe2(consumer->stash, O_CLOEXEC | O_NONBLOCK) == -1 || pipe2(pipe, O_CLOEXEC) == -1) {
+			perror("pipe2");
+			for (int j = 0; j <= i; j++) close(ends[j]);
+			fanout_free(fanout);
+			return NULL;
+		}
+		fcntl(consumer->stash[1], F_SETPIPE_SZ, size);
+		fcntl(pipe[1], F_SETFL, O_NONBLOCK);
+		consumer->fd = pipe[1];
+		ends[i + 1] = pipe[0];
 	}
+	return fanout;
+}
 
-	if (chdir(target_dir)) {
-		fprintf(stderr, "cd: %s: no such file or directory\n", target_dir);
-		return;
+/*
+ * Takes the next chunk from the producer into the stash of every consumer still reading.
+ * Returns 1 if it took one, 0 if there's nothing yet and -1 at the end of the producer's output.
+ */
+
+int _fanout_take(Fanout *fanout) {
+	int live[fanout->count];
+	int nlive = 0;
+
+	for (int i = 0; i < fanout->count; i++) {
+		if (fanout->consumers[i].fd != -1) live[nlive++] = i;
 	}
+	if (nlive == 0) return -1; // nobody left to read it, the producer gets EPIPE
 
-	if (target_dir != home_dir && line->commands[0].argv[1] != target_dir) {
-		memset(target_dir, '\0', sizeof(target_dir));
-		free(target_dir);
+	size_t len = ~(size_t) 0;
+	for (int k = 0; k < nlive; k++) {
+		Consumer *consumer = &fanout->consumers[live[k]];
+		const ssize_t n = k < nlive - 1 ? tee(fanout->fd, consumer->stash[1], len, SPLICE_F_NONBLOCK) :
+			splice(fanout->fd, NULL, consumer->stash[1], NULL, len, SPLICE_F_NONBLOCK);
+		if (n == 0) return -1;
+		if (n == -1) return errno == EAGAIN ? 0 : -1;
+		len = n;
 	}
+	for (int k = 0; k < nlive; k++) fanout->consumers[live[k]].pending = len;
+	fanout->chunks++;
+	return 1;
 }
 
 /*
- * For each command in ncommands
- * Check if it is cd/exit/fg/jobs (builtins) and call the function
- * Else call execute_command(command[i])
- *
+ * Splices what's pending into every consumer, returns how many still have bytes pending
+ */
+
+int _fanout_push(Fanout *fanout) {
+	int waiting = 0, alone = -1;
+
+	for (int i = 0; i < fanout->count; i++) {
+		Consumer *consumer = &fanout->consumers[i];
+		while (consumer->pending > 0) {
+			const ssize_t n = splice(consumer->stash[0], NULL, consumer->fd, NULL, consumer->pending, SPLICE_F_NONBLOCK);
+			if (n > 0) {
+				consumer->pending -= n;
+				consumer->bytes += n;
+			} else if (n == -1 && errno == EAGAIN) {
+				consumer->full++;
+				break;
+			} else { // EPIPE, it exited
+				_close_consumer(consumer);
+			}
+		}
+		if (consumer->pending == 0 && consumer->alone_since != 0) {
+			consumer->held += _now() - consumer->alone_since;
+			consumer->alone_since = 0;
+		}
+		if (consumer->pending > 0) {
+			waiting++;
+			alone = i;
+		}
+	}
+	if (waiting == 1 && fanout->consumers[alone].alone_since == 0) fanout->consumers[alone].alone_since = _now();
+	return waiting;
+}
+
+/*
+ * Moves as much as the pipes allow without blocking. The consumers get EOF once the producer's
+ * output has been delivered, and one that exits early is dropped while the others go on.
  */
 
-void eval(const tline * line, char * command) {
-	if (!strcmp(line->commands[0].argv[0], "cd")) {
-		cd(line);
-	} else if (!strcmp(line->commands[0].argv[0], "exit") || !strcmp(line->commands[0].argv[0], "quit")) {
-		if (job_count > 0) {
-			char try;
-			printf("There are running jobs, are you sure? (y/n): ");
-			scanf(" %c", &try);
-			while (getchar() != '\n');
-			if (try == 'n') return;
-			free(jobs);
+void fanout_pump(Fanout *fanout) {
+	while (_fanout_push(fanout) == 0) {
+		if (fanout->fd == -1) { // all delivered
+			fanout_close(fanout);
+			return;
+		}
+		const int took = _fanout_take(fanout);
+		if (took == 0) return;
+		if (took == -1) {
+			close(fanout->fd);
+			fanout->fd = -1;
 		}
-		exit(0);
-	} else if (!strcmp(line->commands[0].argv[0], "fg")) {
-		line->commands[0].argv[1] == NULL ? fg(jobs[0].id) : fg(atoi(line->commands[0].argv[1]));
 	}
-	else if (!strcmp(line->commands[0].argv[0], "jobs")) {
-		print_jobs();
-	} else {
-		execute_pipeline(line, command);
+}
+
+/*
+ * Fills fds with what the pump waits for: the producer's output once every consumer has taken the last chunk,
+ * room in the pipes of the consumers that have bytes pending. Returns how many, at most count + 1.
+ */
+
+int fanout_poll(const Fanout *fanout, struct pollfd *fds) {
+	int n = 0;
+
+	for (int i = 0; i < fanout->count; i++) {
+		if (fanout->consumers[i].pending == 0) continue;
+		fds[n].fd = fanout->consumers[i].fd;
+		fds[n++].events = POLLOUT;
+	}
+	if (n == 0 && fanout->fd != -1) {
+		fds[n].fd = fanout->fd;
+		fds[n++].events = POLLIN;
 	}
+	return n;
+}
 
+void print_fanout(FILE *out, const char *prefix, const Fanout *fanout) {
+	for (int i = 0; i < fanout->count; i++) {
+		const Consumer *consumer = &fanout->consumers[i];
+		fprintf(out, "%sconsumer %d\t%llu bytes, pipe full %llu times, held the producer %.3fs\n", prefix, i + 1,
+			consumer->bytes, consumer->full, consumer->held);
+	}
 }
 
+/*
+ * Performance counters (set -o perf)
+ *
+ * Every stage forked by the shell gets perf_event_open counters, opened by the shell on the child between
+ * fork() and execve(): the child waits on a pipe until they're open. They are created disabled with
+ * enable_on_exec, so they count the program and not the shell's child code, and with inherit, so they
+ * also count whatever the program forks. The software ones work on any kernel; cycles and instructions
+ * only where the PMU is available (not on most VMs), and they're skipped after the first failure.
+ * Events are retried without kernel time if perf_event_paranoid forbids it. Stages spawned by the zygote
+ * get no counters, they're exec'd before the shell knows their pid.
+ * The values are read when the stage is reaped. task-clock against the stage's lifetime tells whether it
+ * spent its time on the CPU or blocked.
+ */
 
-int main (void) 
-{
-	signal(SIGINT, SIG_IGN);
-	signal(SIGQUIT, SIG_IGN);
-	signal(SIGCHLD, sigchld_handler);
+typedef struct PerfEvent {
+	unsigned int type;
+	unsigned long long config;
+	const char *name;
+} PerfEvent;
 
-	while (1) {
-		char buf[BUFSIZE] = {0};
-		char path[BUFSIZE] = {0};
+const PerfEvent perf_events[PERF_COUNTERS] = {
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page faults" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context switches" },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "migrations" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+};
 
-		getcwd(path, sizeof(path)); // getcwd() to print it inside the prompt
-		printf("msh> ");
+enum { PERF_TASK_CLOCK, PERF_FAULTS, PERF_SWITCHES, PERF_MIGRATIONS, PERF_CYCLES, PERF_INSTRUCTIONS };
 
-		if (fgets(buf, BUFSIZE, stdin) == NULL) {
-			printf("\n");
-			break;
+int perf_unavailable[PERF_COUNTERS] = { 0 };
+int perf_user_only = 0; // perf_event_paranoid only lets us count user time
+int perf_next = 0; // time -v: the next pipeline gets counters without set -o perf
+
+Counters *last_counters = NULL; // of the last job removed, for time -v
+int last_counters_count = 0;
+
+/*
+ * Opens the counters of every event on pid, which hasn't exec'd yet (-1 only clears them)
+ */
+
+void counters_open(Counters *counters, const pid_t pid) {
+	counters->started = _now();
+	counters->ended = 0;
+	counters->opened = 0;
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		counters->fds[i] = -1;
+		counters->values[i] = 0;
+		if (perf_unavailable[i] || pid == -1) continue;
+
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.disabled = 1;
+		attr.enable_on_exec = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = attr.exclude_hv = perf_user_only;
+
+		int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if (fd == -1 && errno == EACCES && !perf_user_only) {
+			attr.exclude_kernel = attr.exclude_hv = 1;
+			fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+			if (fd != -1) perf_user_only = 1;
+		}
+		if (fd == -1 && errno != ESRCH) perf_unavailable[i] = 1;
+		if (fd != -1) counters->opened |= 1u << i;
+		counters->fds[i] = fd;
+	}
+}
+
+/*
+ * Reads the counters (scaled if they were multiplexed), closing them if final is set
+ */
+
+void counters_read(Counters *counters, const int final) {
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		unsigned long long value[3]; // value, time enabled, time running
+		if (counters->fds[i] == -1) continue;
+		if (read(counters->fds[i], value, sizeof(value)) == sizeof(value)) {
+			counters->values[i] = value[2] > 0 && value[2] < value[1] ? (double) value[0] * value[1] / value[2] : value[0];
+		}
+		if (final) {
+			close(counters->fds[i]);
+			counters->fds[i] = -1;
+		}
+	}
+	if (final) counters->ended = _now();
+}
+
+void counters_close(Counters *counters, const int count) {
+	for (int i = 0; i < count; i++) {
+		for (int j = 0; j < PERF_COUNTERS; j++) {
+			if (counters[i].fds[j] != -1) close(counters[i].fds[j]);
+			counters[i].fds[j] = -1;
 		}
-		if (buf != NULL) {
+	}
+}
+
+void print_counters(FILE *out, const char *prefix, const Counters *counters, const int index) {
+	const double alive = (counters->ended > 0 ? counters->ended : _now()) - counters->started;
+	int any = 0;
 
-				const tline *line = tokenize(buf);
+	fprintf(out, "%sstage %d", prefix, index + 1);
+	for (int i = 0; i < PERF_COUNTERS; i++) {
+		const unsigned long long value = counters->values[i];
+		if (!(counters->opened & (1u << i))) continue;
+		fputs(any++ ? ", " : "\t", out);
+		if (i == PERF_TASK_CLOCK) {
+			fprintf(out, "task-clock %.3fs (%.0f%% of %.3fs alive)", value / 1e9, alive > 0 ? value / 1e9 / alive * 100 : 0.0, alive);
+		} else if (i == PERF_INSTRUCTIONS && counters->values[PERF_CYCLES] > 0) {
+			fprintf(out, "%llu %s (%.2f per cycle)", value, perf_events[i].name, (double) value / counters->values[PERF_CYCLES]);
+		} else {
+			fprintf(out, "%llu %s", value, perf_events[i].name);
+		}
+	}
+	fputs(any ? "\n" : "\tno counters\n", out);
+}
 
-				if(line->ncommands == 0) continue;
+/*
+ * Lowest id not used by any job, so ids stay small and are reused like in other shells
+ */
 
-				eval(line, buf);
+int _free_job_id(void) {
+	for (int id = 0; ; id++) {
+		int used = 0;
+		for (int i = 0; i < job_count && !used; i++) {
+			used = jobs[i].id == id;
 		}
+		if (!used) return id;
 	}
+}
 
+Job *add_job(const tline *line, char* command) {
 
+	if (command[strlen(command) - 1] == '\n') command[strlen(command) - 1] = '\0';
 
-	return 0;
+	jobs = realloc(jobs, sizeof(Job) * (job_count + 1));
+
+	const int id = _free_job_id();
+	Job *job = &jobs[job_count];
+	job->id = id;
+	job->pids = calloc(line->ncommands, sizeof(pid_t));
+	job->cpus = malloc(sizeof(int) * line->ncommands);
+	job->statuses = malloc(sizeof(int) * line->ncommands);
+	for (int i = 0; i < line->ncommands; i++) job->statuses[i] = STAGE_RUNNING;
+	job->command = strdup(command);
+	job->pgid = 0;
+	job->stopped = 0;
+	job->stop_signal = 0;
+	job->num_pids = line->ncommands;
+	job->running = 0;
+	job->foreground = !line->background;
+	job->done = 0;
+	job->capture_fd = -1;
+	job->timer_fd = -1;
+	job->timed_out = 0;
+	job->fanout = NULL;
+	job->counters = NULL;
+	ring_init(&job->output);
+
+	job_count++;
+	return job;
+}
+
+void _remove_job(const int index) {
+	free(jobs[index].pids);
+	free(jobs[index].cpus);
+	free(jobs[index].statuses);
+	free(jobs[index].command);
+	if (jobs[index].capture_fd != -1) close(jobs[index].capture_fd);
+	if (jobs[index].timer_fd != -1) close(jobs[index].timer_fd);
+	if (jobs[index].fanout != NULL) {
+		fanout_close(jobs[index].fanout);
+		if (last_fanout != NULL) fanout_free(last_fanout);
+		last_fanout = jobs[index].fanout;
+	}
+	if (jobs[index].counters != NULL) {
+		counters_close(jobs[index].counters, jobs[index].num_pids);
+		free(last_counters);
+		last_counters = jobs[index].counters;
+		last_counters_count = jobs[index].num_pids;
+	}
+	ring_free(&jobs[index].output);
+	for (int j = index; j < job_count - 1; j++) {
+		jobs[j] = jobs[j + 1];
+	}
+
+	job_count--;
+	if (job_count == 0) {
+		free(jobs);
+		jobs = NULL;
+	} else {
+		jobs = realloc(jobs, sizeof(Job) * job_count);
+	}
+}
+
+void delete_job(const int job_id) {
+	for (int i = 0; i < job_count; i++) {
+		if (jobs[i].id == job_id) {
+			_remove_job(i);
+			printf("Deleted job [%d]\n", job_id);
+			return;
+		}
+	}
+	fprintf(stderr, "Job ID %d not found\n", job_id);
+}
+
+Job *_get_job(int id) {
+	for (int i = 0; i < job_count; i++) {
+		if (jobs[i].id == id) {
+			return &jobs[i];
+		}
+	}
+	return NULL;
+}
+
+Job *_get_job_by_pid(const pid_t pid) {
+	for (int i = 0; i < job_count; i++) {
+		for (int j = 0; j < jobs[i].num_pids; j++) {
+			if (jobs[i].pids[j] == pid) {
+				return &jobs[i];
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Called once a background job has no pids left and its capture pipe reached EOF.
+ * Jobs with captured output stay in the table (as Done) until `output` reads them,
+ * only the MAX_DONE_JOBS most recent ones are kept.
+ */
+
+void _finish_job(Job *job) {
+	const int job_id = job->id;
+
+	if (job->output.len == 0 && job->output.spilled == 0) {
+		delete_job(job_id);
+		return;
+	}
+	job->done = 1;
+
+	int done = 0;
+	for (int i = job_count - 1; i >= 0; i--) {
+		if (jobs[i].done && ++done > MAX_DONE_JOBS) {
+			_remove_job(i);
+		}
+	}
+}
+
+/*
+ * The handler only wakes up the event loop, children are reaped in reap_children()
+ */
+
+void sigchld_handler(int sig) {
+	const int saved_errno = errno;
+	(void) sig;
+	if (write(sigchld_pipe[1], "c", 1) == -1) { /* pipe full: the loop will reap anyway */ }
+	errno = saved_errno;
+}
+
+/*
+ * A stage failed if it exited with non zero status or was killed, except by SIGPIPE:
+ * that's how writers normally stop once the reader after them is done
+ */
+
+int stage_failed(const int status) {
+	if (WIFSIGNALED(status)) return WTERMSIG(status) != SIGPIPE;
+	return WEXITSTATUS(status) != 0;
+}
+
+/*
+ * waitpid status of a whole job: the last stage's, or the rightmost failed one's with pipefail.
+ * A job killed for passing its deadline exits with TIMEOUT_STATUS like timeout(1).
+ */
+
+int job_result(const Job *job) {
+	if (job->timed_out) return W_EXITCODE(TIMEOUT_STATUS, 0);
+	if (options[OPT_PIPEFAIL]) {
+		for (int i = job->num_pids - 1; i >= 0; i--) {
+			if (job->statuses[i] >= 0 && stage_failed(job->statuses[i])) return job->statuses[i];
+		}
+	}
+	return job->statuses[job->num_pids - 1] < 0 ? 0 : job->statuses[job->num_pids - 1];
+}
+
+/*
+ * Sends sig to every pid of the job that hasn't been reaped
+ */
+
+void signal_job(const Job *job, const int sig) {
+	if (job->pgid > 0) {
+		kill(-job->pgid, sig);
+		return;
+	}
+	for (int i = 0; i < job->num_pids; i++) {
+		if (job->pids[i] > 0 && job->statuses[i] < 0) kill(job->pids[i], sig);
+	}
+}
+
+/*
+ * Resumes a stopped job. Its stages count as running right away, the WCONTINUED events come later.
+ */
+
+void continue_job(Job *job) {
+	signal_job(job, SIGCONT);
+	for (int i = 0; i < job->num_pids; i++) {
+		if (job->statuses[i] == STAGE_STOPPED) job->statuses[i] = STAGE_RUNNING;
+	}
+	job->stopped = 0;
+}
+
+/*
+ * Updates the job owning pid with a status returned by waitpid (or forwarded by the zygote):
+ * stopped (WUNTRACED), continued (WCONTINUED) or finished
+ */
+
+void job_status(Job *job, const pid_t pid, const int status) {
+	int index = 0;
+	while (index < job->num_pids - 1 && job->pids[index] != pid) index++;
+
+	if (WIFSTOPPED(status)) {
+		if (job->statuses[index] == STAGE_RUNNING) job->stopped++;
+		job->statuses[index] = STAGE_STOPPED;
+		job->stop_signal = WSTOPSIG(status);
+		if (!job->foreground && job->stopped == job->running) {
+			printf("\nJob [%d] (%s) stopped\n", job->id, job->command);
+		}
+		return;
+	}
+	if (WIFCONTINUED(status)) {
+		if (job->statuses[index] == STAGE_STOPPED) job->stopped--;
+		job->statuses[index] = STAGE_RUNNING;
+		return;
+	}
+
+	if (job->statuses[index] == STAGE_STOPPED) job->stopped--;
+	job->statuses[index] = status;
+	job->running--;
+	if (job->counters != NULL) counters_read(&job->counters[index], 1);
+
+	// failfast: don't wait for the other stages to drain
+	if (options[OPT_FAILFAST] && job->running > 0 && stage_failed(status)) {
+		for (int i = 0; i < job->num_pids; i++) {
+			if (job->pids[i] > 0 && job->statuses[i] < 0) kill(job->pids[i], SIGTERM);
+		}
+	}
+	if (job->running > 0 || job->foreground) return;
+
+	const int result = job_result(job);
+	if (job->timed_out) {
+		printf("\nJob [%d] (%s) timed out\n", job->id, job->command);
+	} else if (WIFEXITED(result)) {
+		printf("\nJob [%d] (%s) finished with status %d\n", job->id, job->command, WEXITSTATUS(result));
+	} else if (WIFSIGNALED(result)) {
+		printf("\nJob [%d] terminated with signal %d\n", job->id, WTERMSIG(result));
+	}
+	if (job->capture_fd == -1) _finish_job(job);
+}
+
+/*
+ * Deadlines
+ *
+ * A job with a deadline owns a timerfd polled by the event loop, no helper process is involved.
+ * When it fires every pid still running gets SIGTERM, and the timer is re-armed for TIMEOUT_GRACE
+ * seconds after which they get SIGKILL.
+ * Every job gets a deadline of $JOB_TIMEOUT if it's set, the timeout builtin sets one per pipeline.
+ */
+
+/*
+ * Parses a duration like 30, 1.5m or 2h into seconds, returns 0 if it isn't one
+ */
+
+int parse_duration(const char *str, double *seconds) {
+	char *end;
+
+	*seconds = strtod(str, &end);
+	if (end == str || *seconds < 0) return 0;
+	switch (*end) {
+		case '\0':
+		case 's': break;
+		case 'm': *seconds *= 60; break;
+		case 'h': *seconds *= 60 * 60; break;
+		case 'd': *seconds *= 24 * 60 * 60; break;
+		default: return 0;
+	}
+	return *end == '\0' || end[1] == '\0';
+}
+
+void job_set_deadline(Job *job, const double seconds) {
+	struct itimerspec spec = { { 0, 0 }, { (time_t) seconds, (long) ((seconds - (time_t) seconds) * 1e9) } };
+
+	if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) spec.it_value.tv_nsec = 1; // 0 would disarm it
+	if (job->timer_fd == -1) job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (job->timer_fd == -1 || timerfd_settime(job->timer_fd, 0, &spec, NULL) == -1) perror("timerfd");
+}
+
+void job_timeout(Job *job) {
+	unsigned long long expirations;
+	if (read(job->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+	signal_job(job, job->timed_out == 0 ? SIGTERM : SIGKILL);
+	if (job->stopped > 0) continue_job(job); // or SIGTERM waits until they're resumed
+	if (job->timed_out++ == 0) job_set_deadline(job, TIMEOUT_GRACE);
+}
+
+void child_status(const pid_t pid, const int status) {
+	Job *job = _get_job_by_pid(pid);
+
+	if (job != NULL) job_status(job, pid, status);
+	else script_child_status(pid, status);
+}
+
+void reap_children(void) {
+	pid_t pid;
+	int status;
+	char drain[64];
+
+	while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+
+	while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+		if (pid == zygote_pid && !WIFSTOPPED(status) && !WIFCONTINUED(status)) zygote_lost();
+		else child_status(pid, status);
+	}
+}
+
+/*
+ * fd plan of a stage: fds[k] is the fd of the shell that becomes fd k of the new process,
+ * for the fds 0 to 9 that redirections can name.
+ */
+
+#define STAGE_FDS 10
+#define FD_UNSET -1 // left as the process gets it
+#define FD_CLOSED -2
+
+/*
+ * Applies the plan in a new child. A source that is also the target of another fd (3>&1 1>&2 2>&3)
+ * is copied out of the way first, so the order of the dup2() calls doesn't matter.
+ */
+
+void _apply_fds(const int fds[STAGE_FDS]) {
+	int src[STAGE_FDS];
+
+	for (int k = 0; k < STAGE_FDS; k++) {
+		const int from = fds[k];
+		src[k] = from;
+		if (from >= 0 && from != k && from < STAGE_FDS && fds[from] != FD_UNSET && fds[from] != from) {
+			src[k] = fcntl(from, F_DUPFD_CLOEXEC, STAGE_FDS);
+		}
+	}
+	for (int k = 0; k < STAGE_FDS; k++) {
+		if (src[k] == k) fcntl(k, F_SETFD, 0); // dup2() would have cleared O_CLOEXEC
+		else if (src[k] >= 0) dup2(src[k], k);
+		else if (src[k] == FD_CLOSED) close(k);
+	}
+}
+
+/*
+ * Zygote spawn server (set -o zygote)
+ *
+ * A helper forked when the option is first enabled, so a shell that never uses it pays nothing. With
+ * $MSH_ZYGOTE set to anything but an empty string, main() forks it at startup instead, before the rc file
+ * or any script is loaded, so its address space is the small one of a shell that hasn't done anything
+ * yet, and turns the option on. Disabling the option only stops routing stages through it; enabling it
+ * after the zygote died forks a new one from the shell as it is then.
+ * Spawn requests go through a SOCK_SEQPACKET socketpair: a ZygoteRequest header followed by the
+ * executable path, argv and envp as NUL terminated strings, plus the fds of the new process
+ * passed with SCM_RIGHTS, in the order of its plan. The zygote forks from its own small address space and replies with the pid.
+ * Its children are not the shell's, so it also forwards their wait statuses.
+ */
+
+typedef struct ZygoteRequest {
+	int argc;
+	int envc;
+	pid_t pgid; // like spawn_stage()
+	int fds[STAGE_FDS]; // the plan, with the index of each passed fd in place of the fd itself
+} ZygoteRequest;
+
+typedef struct ZygoteReply {
+	char type; // 'P' pid of a new child | 'S' wait status of a child
+	pid_t pid;
+	int status;
+} ZygoteReply;
+
+int zygote_fd = -1;
+pid_t *zygote_children = NULL; // spawned by the zygote and not reported as finished yet
+int zygote_child_count = 0;
+int zygote_child_cap = 0;
+
+extern char **environ;
+
+void _zygote_exec(char *msg, const int fds[STAGE_FDS]) {
+	const ZygoteRequest *req = (ZygoteRequest *) msg;
+	char *argv[req->argc + 1];
+	char *envp[req->envc + 1];
+	char *p = msg + sizeof(ZygoteRequest);
+
+	char *path = p;
+	p += strlen(p) + 1;
+	for (int i = 0; i < req->argc; i++, p += strlen(p) + 1) argv[i] = p;
+	argv[req->argc] = NULL;
+	for (int i = 0; i < req->envc; i++, p += strlen(p) + 1) envp[i] = p;
+	envp[req->envc] = NULL;
+
+	if (req->pgid != -1) setpgid(0, req->pgid);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	signal(SIGTTIN, SIG_DFL);
+	signal(SIGTTOU, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	_apply_fds(fds);
+	execve(path, argv, envp);
+	fprintf(stderr, "Something went wrong!\n");
+	_exit(1);
+}
+
+void _zygote_main(const int sock) {
+	struct pollfd fds[2] = { { sock, POLLIN, 0 }, { sigchld_pipe[0], POLLIN, 0 } };
+
+	while (1) {
+		if (poll(fds, 2, -1) == -1) continue;
+
+		if (fds[1].revents) {
+			char drain[64];
+			pid_t pid;
+			int status;
+
+			while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0);
+			while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+				const ZygoteReply reply = { 'S', pid, status };
+				send(sock, &reply, sizeof(reply), 0);
+			}
+		}
+		if (fds[0].revents) {
+			const ssize_t size = recv(sock, NULL, 0, MSG_PEEK | MSG_TRUNC);
+			if (size <= 0) _exit(0); // the shell is gone
+
+			char *msg = malloc(size + 1);
+			int passed[STAGE_FDS];
+			int child_fds[STAGE_FDS];
+			char control[CMSG_SPACE(sizeof(passed))];
+			struct iovec iov = { msg, size };
+			struct msghdr hdr = { 0 };
+			hdr.msg_iov = &iov;
+			hdr.msg_iovlen = 1;
+			hdr.msg_control = control;
+			hdr.msg_controllen = sizeof(control);
+
+			if (recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC) != size) {
+				free(msg);
+				continue;
+			}
+			const struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); // none if the plan closes every fd
+			int npassed = 0;
+			if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+				cmsg->cmsg_len >= CMSG_LEN(0) && cmsg->cmsg_len <= CMSG_LEN(sizeof(passed))) {
+				npassed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				memcpy(passed, CMSG_DATA(cmsg), sizeof(int) * npassed);
+			}
+
+			// the plan must name exactly the fds that came with it
+			int expected = 0, valid = size >= (ssize_t) sizeof(ZygoteRequest) && !(hdr.msg_flags & MSG_CTRUNC);
+			for (int k = 0; valid && k < STAGE_FDS; k++) {
+				const int index = ((ZygoteRequest *) msg)->fds[k];
+				if (index >= 0) valid = index == expected++;
+				child_fds[k] = index >= 0 && index < npassed ? passed[index] : index;
+			}
+			if (!valid || expected != npassed) {
+				for (int k = 0; k < npassed; k++) close(passed[k]);
+				free(msg);
+				const ZygoteReply reply = { 'P', -1, 0 };
+				send(sock, &reply, sizeof(reply), 0);
+				continue;
+			}
+
+			const pid_t pid = fork();
+			if (pid == 0) _zygote_exec(msg, child_fds);
+
+			// also done here, the next stage may join the group before the child gets to run
+			const pid_t pgid = ((ZygoteRequest *) msg)->pgid;
+			if (pid > 0 && pgid != -1) setpgid(pid, pgid == 0 ? pid : pgid);
+
+			for (int k = 0; k < npassed; k++) close(passed[k]);
+			free(msg);
+			const ZygoteReply reply = { 'P', pid, 0 };
+			send(sock, &reply, sizeof(reply), 0);
+		}
+	}
+}
+
+void zygote_start(void) {
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("socketpair");
+		return;
+	}
+
+	const pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+	if (pid == 0) {
+		close(sv[0]);
+		close(sigchld_pipe[0]);
+		close(sigchld_pipe[1]);
+		if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) _exit(1);
+		for (int i = 0; i < job_count; i++) {
+			if (jobs[i].capture_fd != -1) close(jobs[i].capture_fd);
+			if (jobs[i].timer_fd != -1) close(jobs[i].timer_fd);
+			if (jobs[i].fanout != NULL) fanout_close(jobs[i].fanout);
+			if (jobs[i].counters != NULL) counters_close(jobs[i].counters, jobs[i].num_pids);
+		}
+		_zygote_main(sv[1]);
+	}
+	close(sv[1]);
+	zygote_fd = sv[0];
+	zygote_pid = pid;
+}
+
+/*
+ * Handles one message from the zygote, returns the pid if it was a spawn reply
+ */
+
+pid_t _zygote_reply(const ZygoteReply *reply) {
+	if (reply->type == 'P') {
+		if (reply->pid > 0) {
+			if (zygote_child_count == zygote_child_cap) {
+				zygote_child_cap = zygote_child_cap == 0 ? 16 : zygote_child_cap * 2;
+				zygote_children = realloc(zygote_children, sizeof(pid_t) * zygote_child_cap);
+			}
+			zygote_children[zygote_child_count++] = reply->pid;
+		}
+		return reply->pid;
+	}
+	if (!WIFSTOPPED(reply->status) && !WIFCONTINUED(reply->status)) {
+		for (int i = 0; i < zygote_child_count; i++) {
+			if (zygote_children[i] == reply->pid) zygote_children[i] = zygote_children[--zygote_child_count];
+		}
+	}
+	child_status(reply->pid, reply->status);
+	return 0;
+}
+
+/*
+ * Stops using the zygote, stages are forked by the shell from now on
+ */
+
+void zygote_close(void) {
+	close(zygote_fd);
+	zygote_fd = -1;
+	options[OPT_ZYGOTE] = 0;
+}
+
+void zygote_drain(void) {
+	ZygoteReply reply;
+	ssize_t n;
+
+	while ((n = recv(zygote_fd, &reply, sizeof(reply), MSG_DONTWAIT)) == sizeof(reply)) {
+		_zygote_reply(&reply);
+	}
+	if (n == 0) zygote_close(); // the zygote died, spawn by forking again
+}
+
+/*
+ * The zygote was reaped. The statuses of the stages it still owned will never come,
+ * so they finish as failed and whoever waits for their jobs can go on.
+ */
+
+void zygote_lost(void) {
+	if (zygote_fd != -1) zygote_drain(); // the statuses it sent before dying
+	if (zygote_fd != -1) zygote_close();
+	zygote_pid = -1;
+
+	if (zygote_child_count > 0) {
+		fprintf(stderr, "msh: the zygote died, %d command%s it spawned reported as failed\n", zygote_child_count,
+			zygote_child_count == 1 ? "" : "s");
+	}
+	while (zygote_child_count > 0) child_status(zygote_children[--zygote_child_count], W_EXITCODE(1, 0));
+}
+
+pid_t zygote_spawn(const tcommand *command, const int fds[STAGE_FDS], const pid_t pgid, char **envp) {
+	int envc = 0;
+	size_t size = sizeof(ZygoteRequest) + strlen(command->filename) + 1;
+
+	for (int i = 0; i < command->argc; i++) size += strlen(command->argv[i]) + 1;
+	for (; envp[envc] != NULL; envc++) size += strlen(envp[envc]) + 1;
+
+	char *msg = malloc(size);
+	ZygoteRequest *req = (ZygoteRequest *) msg;
+	req->argc = command->argc;
+	req->envc = envc;
+	req->pgid = pgid;
+	int passed[STAGE_FDS];
+	int npassed = 0;
+	for (int k = 0; k < STAGE_FDS; k++) {
+		if (fds[k] >= 0) passed[npassed] = fds[k];
+		req->fds[k] = fds[k] >= 0 ? npassed++ : fds[k];
+	}
+	char *p = stpcpy(msg + sizeof(ZygoteRequest), command->filename) + 1;
+	for (int i = 0; i < command->argc; i++) p = stpcpy(p, command->argv[i]) + 1;
+	for (int i = 0; i < envc; i++) p = stpcpy(p, envp[i]) + 1;
+
+	char control[CMSG_SPACE(sizeof(passed))] = { 0 };
+	struct iovec iov = { msg, size };
+	struct msghdr hdr = { 0 };
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = CMSG_SPACE(sizeof(int) * npassed);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * npassed);
+	memcpy(CMSG_DATA(cmsg), passed, sizeof(int) * npassed);
+	if (npassed == 0) {
+		hdr.msg_control = NULL;
+		hdr.msg_controllen = 0;
+	}
+
+	const ssize_t sent = sendmsg(zygote_fd, &hdr, MSG_NOSIGNAL);
+	free(msg);
+	if (sent != (ssize_t) size) {
+		perror("msh: zygote");
+		zygote_close();
+		return -1;
+	}
+
+	// statuses of older children may arrive before the reply
+	ZygoteReply reply;
+	pid_t pid;
+	do {
+		const ssize_t n = recv(zygote_fd, &reply, sizeof(reply), 0);
+		if (n == -1 && errno == EINTR) continue;
+		if (n != sizeof(reply)) {
+			if (n == -1) perror("msh: zygote");
+			zygote_close();
+			return -1;
+		}
+	} while ((pid = _zygote_reply(&reply)) == 0);
+
+	return pid;
+}
+
+/*
+ * Starts command with the fd plan fds, through the zygote if it's enabled.
+ * Every other fd of the shell is O_CLOEXEC, so the program gets nothing else.
+ * pgid is the process group to join: 0 starts a new one, -1 stays in the shell's (no job control).
+ */
+
+pid_t spawn_stage(const tcommand *command, const int fds[STAGE_FDS], const pid_t pgid, Counters *counters) {
+	char **envp = shell_envp();
+	int go[2] = { -1, -1 }; // closed by the shell once the counters are open
+
+	if (counters != NULL) counters_open(counters, -1);
+	if (options[OPT_ZYGOTE] && zygote_fd != -1) {
+		const pid_t pid = zygote_spawn(command, fds, pgid, envp);
+		if (pid != -1) return pid;
+		// the zygote is gone or couldn't fork, the shell does it
+	}
+	if (counters != NULL && pipe2(go, O_CLOEXEC) == -1) go[0] = go[1] = -1;
+
+	const pid_t pid = fork();
+
+	if (pid == 0) { // Child
+		if (go[0] != -1) {
+			char c;
+			close(go[1]);
+			while (read(go[0], &c, 1) == -1 && errno == EINTR) {}
+			close(go[0]);
+		}
+		if (pgid != -1) setpgid(0, pgid);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		signal(SIGTSTP, SIG_DFL);
+		signal(SIGTTIN, SIG_DFL);
+		signal(SIGTTOU, SIG_DFL);
+		signal(SIGPIPE, SIG_DFL);
+		_apply_fds(fds);
+
+		execve(command->filename, command->argv, envp); // filename already has the PATH lookup done
+		fprintf(stderr, "Something went wrong!\n");
+		exit(1);
+	}
+	if (go[0] != -1) {
+		if (pid > 0) counters_open(counters, pid);
+		close(go[0]);
+		close(go[1]);
+	}
+	if (pid > 0 && pgid != -1) setpgid(pid, pgid == 0 ? pid : pgid); // whichever runs first
+	return pid;
+}
+
+/*
+ * Reads everything available from a job's capture pipe without blocking
+ */
+
+void drain_capture(Job *job) {
+	char buf[BUFSIZE * 4];
+	ssize_t n;
+
+	while ((n = read(job->capture_fd, buf, sizeof(buf))) > 0) {
+		ring_write(&job->output, buf, n);
+	}
+	if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+		close(job->capture_fd);
+		job->capture_fd = -1;
+		if (job->running == 0 && !job->foreground) _finish_job(job);
+	}
+}
+
+/*
+ * Handles fd of job becoming readable: captured output or its deadline
+ */
+
+void job_event(const int job_id, const int fd) {
+	Job *job = _get_job(job_id); // the table may have changed while handling other jobs
+
+	if (job == NULL) return;
+	if (job->capture_fd == fd) drain_capture(job);
+	else if (job->timer_fd == fd) job_timeout(job);
+	else if (job->fanout != NULL) fanout_pump(job->fanout);
+}
+
+/*
+ * Fills fds with what the event loop waits for on behalf of job (handled by job_event()), returns how many.
+ * There are at most job_poll_max() of them.
+ */
+
+int job_poll_max(const Job *job) {
+	return 2 + (job->fanout != NULL ? job->fanout->count + 1 : 0);
+}
+
+int job_poll(const Job *job, struct pollfd *fds) {
+	int n = 0;
+
+	if (job->capture_fd != -1) {
+		fds[n].fd = job->capture_fd;
+		fds[n++].events = POLLIN;
+	}
+	if (job->timer_fd != -1) {
+		fds[n].fd = job->timer_fd;
+		fds[n++].events = POLLIN;
+	}
+	if (job->fanout != NULL) n += fanout_poll(job->fanout, fds + n);
+	return n;
+}
+
+/*
+ * Event loop: waits until a child changes state, a job writes captured output or passes its deadline,
+ * or wait_fd (if it isn't -1) becomes readable.
+ * Returns 1 if wait_fd is readable, 0 otherwise.
+ */
+
+int event_loop_wait(const int wait_fd) {
+	if (current_script != NULL) return script_yield(wait_fd); // the scheduler polls for every script
+
+	int nfds = 4;
+	for (int i = 0; i < job_count; i++) nfds += job_poll_max(&jobs[i]);
+
+	struct pollfd fds[nfds];
+	int job_ids[nfds];
+	nfds = 0;
+
+	fds[nfds].fd = sigchld_pipe[0];
+	fds[nfds++].events = POLLIN;
+	fds[nfds].fd = zygote_fd; // poll() ignores it while it's -1
+	fds[nfds++].events = POLLIN;
+	fds[nfds].fd = prompt_pipe[0];
+	fds[nfds++].events = POLLIN;
+	for (int i = 0; i < job_count; i++) {
+		const int n = job_poll(&jobs[i], fds + nfds);
+		for (int k = 0; k < n; k++) job_ids[nfds++] = jobs[i].id;
+	}
+	if (wait_fd != -1) {
+		fds[nfds].fd = wait_fd;
+		fds[nfds++].events = POLLIN;
+	}
+
+	if (poll(fds, nfds, -1) == -1) {
+		if (errno != EINTR) perror("poll");
+		return 0;
+	}
+
+	int ready = 0;
+	for (int i = 3; i < nfds; i++) {
+		if (fds[i].revents == 0) continue;
+		if (fds[i].fd == wait_fd) {
+			ready = 1;
+			continue;
+		}
+		job_event(job_ids[i], fds[i].fd);
+	}
+	if (fds[0].revents) reap_children();
+	if (fds[1].revents) zygote_drain();
+	if (fds[2].revents) prompt_repaint();
+
+	return ready;
+}
+
+/*
+ * Converts a waitpid status into a shell exit status (128 + signal for killed or stopped processes)
+ */
+
+int exit_code(const int status) {
+	if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+	if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+ * $PIPESTATUS holds the exit status of every stage of the last foreground pipeline, separated by spaces
+ */
+
+void set_pipestatus(const int *codes, const int n) {
+	char buf[n * 4 + 1];
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; i < n; i++) {
+		len += snprintf(buf + len, sizeof(buf) - len, i == 0 ? "%d" : " %d", codes[i]);
+	}
+	var_set("PIPESTATUS", 10, buf, 0);
+}
+
+/*
+ * Waits for every pid of the job to exit, dispatching the event loop meanwhile
+ * so background jobs keep draining. The job is removed afterwards, after setting $PIPESTATUS.
+ * Returns the waitpid status of the job (see job_result()).
+ * A job that gets stopped (Ctrl-Z) stays in the table as a background job, and its stop status is returned.
+ */
+
+int wait_job(const int job_id) {
+	Job *job;
+	int status = 0;
+
+	while ((job = _get_job(job_id)) != NULL && job->running > 0 && job->stopped < job->running) {
+		event_loop_wait(-1);
+	}
+	if (job != NULL && job->running > 0) {
+		job->foreground = 0;
+		printf("\n[%d] Stopped \t\t%s\n", job->id, job->command);
+		return W_STOPCODE(job->stop_signal);
+	}
+	if (job != NULL) {
+		int codes[job->num_pids];
+		for (int i = 0; i < job->num_pids; i++) {
+			codes[i] = job->statuses[i] < 0 ? 0 : exit_code(job->statuses[i]);
+			if (job->statuses[i] >= 0 && WIFSIGNALED(job->statuses[i]) && WTERMSIG(job->statuses[i]) == SIGINT) {
+				interrupted = 1;
+			}
+		}
+		set_pipestatus(codes, job->num_pids);
+		status = job_result(job);
+		for (int i = 0; i < job_count; i++) {
+			if (jobs[i].id == job_id) _remove_job(i);
+		}
+	}
+	return status;
+}
+
+/*
+ * wait_job() for a foreground job, with the terminal handed to its process group meanwhile
+ */
+
+int wait_foreground(const int job_id) {
+	const Job *job = _get_job(job_id);
+
+	if (job_control && job != NULL && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid);
+	const int status = wait_job(job_id);
+	if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+	return status;
+}
+
+/*
+ * getline() replacement that reads through the event loop, so captured output
+ * is drained and children are reaped while the shell waits at the prompt.
+ * Returns the next line of stdin with its \n, whatever its length, in a buffer reused by the next call.
+ */
+
+char *read_line(void) {
+	static char *in = NULL; // in[start..len) is read but not returned yet, with no \n before scanned
+	static size_t start = 0, scanned = 0, len = 0, cap = 0;
+	static char *line = NULL;
+	static size_t line_cap = 0;
+	static int eof = 0;
+
+	while (1) {
+		char *nl = len > scanned ? memchr(in + scanned, '\n', len - scanned) : NULL;
+		if (nl != NULL || (eof && len > start)) {
+			const size_t n = (nl != NULL ? (size_t) (nl - in) + 1 : len) - start;
+			if (n + 1 > line_cap) {
+				line_cap = n + 1 > line_cap * 2 ? n + 1 : line_cap * 2;
+				line = realloc(line, line_cap);
+			}
+			memcpy(line, in + start, n);
+			line[n] = '\0';
+			start = scanned = start + n;
+			return line;
+		}
+		scanned = len;
+		if (eof) return NULL;
+
+		if (!event_loop_wait(STDIN_FILENO)) continue;
+
+		if (start > 0) { // once per read, not once per line
+			memmove(in, in + start, len - start);
+			len -= start;
+			scanned -= start;
+			start = 0;
+		}
+		if (len == cap) { // a line longer than the buffer
+			cap = cap == 0 ? BUFSIZE * 4 : cap * 2;
+			in = realloc(in, cap);
+		}
+		const ssize_t n = read(STDIN_FILENO, in + len, cap - len);
+		if (n == 0) eof = 1;
+		else if (n == -1 && errno != EINTR && errno != EAGAIN) eof = 1;
+		else if (n > 0) len += n;
+	}
+}
+
+/*
+ * jobs -l also lists the pid of every stage and the CPU it's pinned to
+ */
+
+void print_jobs(const int long_format) {
+	if (job_count <= 0) {
+		printf("%s", "There are no jobs.\n");
+	} else {
+		for (int i = 0; i < job_count; i++) {
+			const char *state = jobs[i].timed_out ? "Timed out" :
+				jobs[i].done || jobs[i].running == 0 ? "Done" :
+				jobs[i].stopped == jobs[i].running ? "Stopped" : "Running";
+			printf("[%d] %s \t\t%s\n", jobs[i].id, state, jobs[i].command);
+			for (int j = 0; long_format && j < jobs[i].num_pids; j++) {
+				if (jobs[i].cpus[j] == -1) printf("\t%d\n", jobs[i].pids[j]);
+				else printf("\t%d\tcpu %d\n", jobs[i].pids[j], jobs[i].cpus[j]);
+			}
+			if (long_format && jobs[i].fanout != NULL) print_fanout(stdout, "\t", jobs[i].fanout);
+			for (int j = 0; long_format && jobs[i].counters != NULL && j < jobs[i].num_pids; j++) {
+				if (jobs[i].counters[j].ended == 0) counters_read(&jobs[i].counters[j], 0);
+				print_counters(stdout, "\t", &jobs[i].counters[j], j);
+			}
+		}
+	}
+}
+
+/*
+ * Job argument of fg, bg and kill: %n or n, the most recent job if arg is NULL. Returns -1 if there's none.
+ */
+
+int job_arg(const char *arg) {
+	if (arg == NULL) return job_count > 0 ? jobs[job_count - 1].id : -1;
+	return atoi(arg[0] == '%' ? arg + 1 : arg);
+}
+
+/*
+ * Definitions of fg and bg shell builtins
+ *
+ * Both resume a stopped job with SIGCONT, fg then waits for it with the terminal handed over.
+ */
+
+int fg(const int job_id) {
+	Job *job = _get_job(job_id);
+
+	if (job != NULL) {
+		if (job->running > 0) {
+			job->foreground = 1;
+			printf("%s\n", job->command);
+			if (job_control && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid); // before it runs again
+			if (job->stopped > 0) continue_job(job);
+			return exit_code(wait_foreground(job_id));
+		} else {
+			printf("Job [%d] is not running.\n", job_id);
+		}
+
+	} else {
+		fprintf(stderr, "\nInvalid job ID %d", job_id);
+	}
+
+	return 1;
+}
+
+int bg(const int job_id) {
+	Job *job = _get_job(job_id);
+
+	if (job == NULL) {
+		fprintf(stderr, "bg: Invalid job ID %d\n", job_id);
+		return 1;
+	}
+	if (job->running == 0) {
+		printf("Job [%d] is not running.\n", job_id);
+		return 1;
+	}
+	job->foreground = 0;
+	if (job->stopped > 0) continue_job(job);
+	const size_t len = strlen(job->command);
+	printf("[%d] %s%s\n", job->id, job->command, len > 0 && job->command[len - 1] == '&' ? "" : " &"); // started with &
+	return 0;
+}
+
+/*
+ * Definition of kill shell builtin
+ *
+ * kill [-SIGNAL] %job|pid...   SIGNAL is a number or a name with or without SIG (TERM by default).
+ *                              A job gets the signal in its whole process group.
+ */
+
+const struct { const char *name; int sig; } signal_names[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL }, { "USR1", SIGUSR1 },
+	{ "USR2", SIGUSR2 }, { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM }, { "CONT", SIGCONT },
+	{ "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU }
+};
+
+int kill_builtin(const tline *line) {
+	char **argv = line->commands[0].argv;
+	int sig = SIGTERM;
+	int i = 1;
+	int status = 0;
+
+	if (argv[1] != NULL && argv[1][0] == '-') {
+		const char *name = argv[1] + 1;
+		if (!strncmp(name, "SIG", 3)) name += 3;
+		sig = *name >= '0' && *name <= '9' ? atoi(name) : -1;
+		for (size_t j = 0; sig == -1 && j < sizeof(signal_names) / sizeof(signal_names[0]); j++) {
+			if (!strcmp(name, signal_names[j].name)) sig = signal_names[j].sig;
+		}
+		if (sig == -1) {
+			fprintf(stderr, "kill: %s: invalid signal\n", argv[1] + 1);
+			return 1;
+		}
+		i++;
+	}
+	if (argv[i] == NULL) {
+		fprintf(stderr, "kill: usage: kill [-SIGNAL] %%job|pid...\n");
+		return 1;
+	}
+
+	for (; argv[i] != NULL; i++) {
+		if (argv[i][0] == '%') {
+			Job *job = _get_job(job_arg(argv[i]));
+			if (job == NULL) {
+				fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+				status = 1;
+				continue;
+			}
+			signal_job(job, sig);
+			if (job->stopped > 0 && (sig == SIGTERM || sig == SIGHUP || sig == SIGCONT)) continue_job(job);
+		} else if (kill(atoi(argv[i]), sig) == -1) {
+			fprintf(stderr, "kill: %s: ", argv[i]);
+			perror("");
+			status = 1;
+		}
+	}
+	return status;
+}
+
+/*
+ * Definition of output shell builtin
+ *
+ * Prints what a captured background job has written so far.
+ * A finished job is deleted once its output has been printed.
+ */
+
+int output(const tline *line) {
+	if (line->commands[0].argv[1] == NULL) {
+		fprintf(stderr, "output: usage: output <job>\n");
+		return 1;
+	}
+
+	const int job_id = atoi(line->commands[0].argv[1]);
+	Job *job = _get_job(job_id);
+
+	if (job == NULL) {
+		fprintf(stderr, "output: Job ID %d not found\n", job_id);
+		return 1;
+	}
+	if (job->capture_fd != -1) drain_capture(job);
+
+	fflush(stdout);
+	ring_dump(&job->output, fileno(stdout));
+	if (job->done) delete_job(job_id);
+	return 0;
+}
+
+void set_option(const int option, const int on) {
+	options[option] = on;
+	// the zygote stays alive when disabled, it still owns the children it spawned
+	if (option == OPT_ZYGOTE && on && zygote_fd == -1) zygote_start();
+}
+
+/*
+ * Definition of set shell builtin
+ *
+ * set             prints every option
+ * set -o name     enables an option
+ * set +o name     disables it
+ */
+
+int set(const tline *line) {
+	char **argv = line->commands[0].argv;
+
+	if (argv[1] == NULL) {
+		for (int i = 0; i < OPT_COUNT; i++) {
+			printf("%-10s %s\n", option_names[i], options[i] ? "on" : "off");
+		}
+		return 0;
+	}
+	if (argv[2] == NULL || (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+		fprintf(stderr, "set: usage: set [-o|+o option]\n");
+		return 1;
+	}
+	for (int i = 0; i < OPT_COUNT; i++) {
+		if (!strcmp(argv[2], option_names[i])) {
+			set_option(i, argv[1][0] == '-');
+			return 0;
+		}
+	}
+	fprintf(stderr, "set: %s: invalid option name\n", argv[2]);
+	return 1;
+}
+
+
+/*
+ * Pipeline stage placement (set -o placement)
+ *
+ * CPUs are ordered by package, then by the group sharing their last level cache, read once from
+ * /sys/devices/system/cpu. Each stage of a multi-stage pipeline is pinned to the next CPU in that order,
+ * starting at a different cache group for each pipeline, so adjacent stages share a cache and their pipe
+ * hops don't cross sockets. Pinning is done by the shell after spawning, so it works with the zygote too.
+ */
+
+typedef struct CpuInfo {
+	int cpu;
+	int package;
+	int llc; // first cpu of the set sharing its last level cache
+} CpuInfo;
+
+int *cpu_order = NULL;
+int cpu_count = 0;
+int *llc_starts = NULL; // index in cpu_order where each cache group begins
+int llc_count = 0;
+int llc_next = 0;
+
+/*
+ * Parses a sysfs cpu list ("0-3,8,10-11") into set, returns 0 if the file can't be read
+ */
+
+int _read_cpu_list(const char *path, cpu_set_t *set) {
+	char buf[BUFSIZE];
+	FILE *f = fopen(path, "r");
+
+	CPU_ZERO(set);
+	if (f == NULL) return 0;
+	const int ok = fgets(buf, sizeof(buf), f) != NULL;
+	fclose(f);
+
+	for (char *p = buf; ok && *p != '\0' && *p != '\n'; ) {
+		char *end;
+		const long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p) break;
+		if (*end == '-') last = strtol(end + 1, &end, 10);
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return ok;
+}
+
+int _read_int(const char *path, const int fallback) {
+	FILE *f = fopen(path, "r");
+	int value = fallback;
+
+	if (f != NULL) {
+		if (fscanf(f, "%d", &value) != 1) value = fallback;
+		fclose(f);
+	}
+	return value;
+}
+
+int _compare_cpus(const void *a, const void *b) {
+	const CpuInfo *x = a, *y = b;
+	if (x->package != y->package) return x->package - y->package;
+	if (x->llc != y->llc) return x->llc - y->llc;
+	return x->cpu - y->cpu;
+}
+
+void _load_topology(void) {
+	cpu_set_t online;
+	char path[BUFSIZE];
+
+	if (!_read_cpu_list("/sys/devices/system/cpu/online", &online) &&
+		sched_getaffinity(0, sizeof(online), &online) == -1) {
+		return;
+	}
+
+	CpuInfo *info = malloc(sizeof(CpuInfo) * CPU_COUNT(&online));
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online)) continue;
+		CpuInfo *c = &info[cpu_count++];
+		c->cpu = cpu;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		c->package = _read_int(path, 0);
+		c->llc = cpu;
+
+		int level = 0;
+		for (int index = 0; ; index++) {
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+			const int l = _read_int(path, -1);
+			if (l == -1) break;
+			if (l < level) continue;
+
+			cpu_set_t shared;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+			if (!_read_cpu_list(path, &shared)) continue;
+			level = l;
+			for (int first = 0; first < CPU_SETSIZE; first++) {
+				if (CPU_ISSET(first, &shared)) { c->llc = first; break; }
+			}
+		}
+	}
+	qsort(info, cpu_count, sizeof(CpuInfo), _compare_cpus);
+
+	cpu_order = malloc(sizeof(int) * cpu_count);
+	llc_starts = malloc(sizeof(int) * cpu_count);
+	for (int i = 0; i < cpu_count; i++) {
+		cpu_order[i] = info[i].cpu;
+		if (i == 0 || info[i].llc != info[i - 1].llc || info[i].package != info[i - 1].package) {
+			llc_starts[llc_count++] = i;
+		}
+	}
+	free(info);
+}
+
+/*
+ * Fills cpus[0..n) with the CPU for each stage of a new pipeline, -1 when placement is off
+ */
+
+void place_stages(int *cpus, const int n) {
+	if (cpu_order == NULL) _load_topology();
+
+	if (!options[OPT_PLACEMENT] || n < 2 || cpu_count < 2) {
+		for (int i = 0; i < n; i++) cpus[i] = -1;
+		return;
+	}
+	const int start = llc_starts[llc_next];
+	llc_next = (llc_next + 1) % llc_count;
+	for (int i = 0; i < n; i++) cpus[i] = cpu_order[(start + i) % cpu_count];
+}
+
+void pin_stage(const pid_t pid, const int cpu) {
+	cpu_set_t set;
+
+	if (cpu == -1) return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(pid, sizeof(set), &set) == -1 && errno != ESRCH) perror("sched_setaffinity");
+}
+
+/*
+ * fd audit (set -o fdaudit)
+ *
+ * Compares /proc/self/fd before and after a pipeline is started. Any new fd is a leak (the job's capture
+ * pipe aside), and any fd above stderr without O_CLOEXEC would be inherited by every child,
+ * keeping pipes open behind their readers' back.
+ */
+
+#define FD_AUDIT_MAX 1024
+
+void fd_snapshot(unsigned char set[FD_AUDIT_MAX / 8]) {
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *ent;
+
+	memset(set, 0, FD_AUDIT_MAX / 8);
+	if (dir == NULL) return;
+	while ((ent = readdir(dir)) != NULL) {
+		const int fd = atoi(ent->d_name);
+		if (ent->d_name[0] == '.' || fd == dirfd(dir) || fd >= FD_AUDIT_MAX) continue;
+		set[fd / 8] |= 1 << (fd % 8);
+	}
+	closedir(dir);
+}
+
+/*
+ * Whether fd is one of the pipes the shell keeps for job
+ */
+
+int job_owns_fd(const Job *job, const int fd) {
+	if (fd == job->capture_fd || fd == job->timer_fd) return 1;
+	for (int i = 0; job->counters != NULL && i < job->num_pids; i++) {
+		for (int j = 0; j < PERF_COUNTERS; j++) {
+			if (fd == job->counters[i].fds[j]) return 1;
+		}
+	}
+	if (job->fanout == NULL) return 0;
+	if (fd == job->fanout->fd) return 1;
+	for (int i = 0; i < job->fanout->count; i++) {
+		const Consumer *consumer = &job->fanout->consumers[i];
+		if (fd == consumer->fd || fd == consumer->stash[0] || fd == consumer->stash[1]) return 1;
+	}
+	return 0;
+}
+
+void fd_audit(const unsigned char before[FD_AUDIT_MAX / 8], const char *cmd, const Job *job) {
+	unsigned char after[FD_AUDIT_MAX / 8];
+
+	fd_snapshot(after);
+	for (int fd = 0; fd < FD_AUDIT_MAX; fd++) {
+		if (!(after[fd / 8] & (1 << (fd % 8)))) continue;
+
+		const int leaked = !(before[fd / 8] & (1 << (fd % 8))) && !job_owns_fd(job, fd);
+		const int inherited = fd > STDERR_FILENO && !(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+		if (!leaked && !inherited) continue;
+
+		char link[64], target[BUFSIZE];
+		snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+		const ssize_t len = readlink(link, target, sizeof(target) - 1);
+		target[len > 0 ? len : 0] = '\0';
+		fprintf(stderr, "fdaudit: fd %d (%s) %s after: %s\n", fd, target,
+			leaked ? "leaked" : "inherited by children", cmd);
+	}
+}
+
+/*
+ * Applies the redirection list of line to the fd plans of its stages, in order. Its files are opened
+ * into files[] (*nfiles of them). Returns 0, or -1 after reporting an error.
+ */
+
+int _plan_redirects(const tline *line, int plan[][STAGE_FDS], int *files, int *nfiles) {
+	for (int i = 0; i < line->nredirects; i++) {
+		const tredirect *r = &line->redirects[i];
+		int *fds = plan[r->command];
+		int fd, flags;
+
+		switch (r->type) {
+		case REDIRECT_READ:
+		case REDIRECT_WRITE:
+		case REDIRECT_APPEND:
+			flags = r->type == REDIRECT_READ ? O_RDONLY : O_CREAT | O_WRONLY | (r->type == REDIRECT_APPEND ? O_APPEND : O_TRUNC);
+			fd = open(r->filename, flags | O_CLOEXEC, 0644);
+			if (fd == -1) {
+				fprintf(stderr, "%s: Error. ", r->filename);
+				perror("open");
+				return -1;
+			}
+			files[(*nfiles)++] = fd;
+			fds[r->fd] = fd;
+			break;
+		case REDIRECT_DUP:
+			fd = fds[r->source_fd];
+			flags = fcntl(r->source_fd, F_GETFD);
+			if (fd == FD_UNSET && flags != -1 && !(flags & FD_CLOEXEC)) fd = r->source_fd; // the shell got it open
+			if (fd < 0) {
+				fprintf(stderr, "%d: Bad file descriptor\n", r->source_fd);
+				return -1;
+			}
+			fds[r->fd] = fd;
+			break;
+		case REDIRECT_CLOSE:
+			fds[r->fd] = FD_CLOSED;
+			break;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Index of the consumer of a fan-out line whose first stage is commands[i], -1 if there's none
+ */
+
+int _consumer_at(const tline *line, const int i) {
+	for (int j = 0; j < line->nconsumers; j++) {
+		if (line->consumers[j] == i) return j;
+	}
+	return -1;
+}
+
+/*
+ * Creates a child process to execute a command via execve
+ * We don't take as a parameter line->command because of the needed use of redirection info
+ * Stores the id of the new job in *job_id and returns 0, or the exit status if it couldn't start
+ *
+ */
+
+int start_pipeline(const tline * line, char *cmd, int *job_id_out) {
+	int capture[2] = { -1, -1 };
+	int redirect[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	unsigned char fds_before[FD_AUDIT_MAX / 8];
+
+	if (options[OPT_FDAUDIT]) fd_snapshot(fds_before);
+
+	for (int j = 0; j < line->ncommands; j++) {
+		if (line->commands[j].filename == NULL) {
+			fprintf(stderr, "%s: No se encuentra el mandato.\n", line->commands[j].argv[0]);
+			return 127;
+		}
+	}
+
+	// with a redirection list the ones tokenize() knows are in it too, applied in their place
+	const char *input = line->nredirects == 0 ? line->redirect_input : NULL;
+	const char *output = line->nredirects == 0 ? line->redirect_output : NULL;
+	const char *error = line->nredirects == 0 ? line->redirect_error : NULL;
+
+	// redirections are opened here so the same fds work for a forked child or one spawned by the zygote
+	if (input != NULL) {
+		redirect[0] = open(input, O_RDONLY | O_CLOEXEC);
+		if (redirect[0] == -1) {
+			fprintf(stderr, "%s: Error. ", input);
+			perror("open");
+			return 1;
+		}
+	}
+	if (output != NULL) {
+		redirect[1] = open(output, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	}
+	if (error != NULL) {
+		redirect[2] = open(error, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	}
+	if (redirect[1] == -1 || redirect[2] == -1) {
+		fprintf(stderr, "%s: Error. ", redirect[1] == -1 ? output : error);
+		perror("open");
+		for (int k = 0; k < 3; k++) {
+			if (redirect[k] > STDERR_FILENO) close(redirect[k]);
+		}
+		return 1;
+	}
+
+	// background output goes into a pipe drained by the event loop
+	if (line->background && options[OPT_CAPTURE]) {
+		if (pipe2(capture, O_CLOEXEC) == -1) {
+			perror("pipe2");
+			capture[0] = capture[1] = -1;
+		}
+	}
+
+	/*
+	 * fd plan: plan[i] holds the fds of stage i (see _apply_fds()), decided before anything is spawned.
+	 * pipes[i] connects stage i to stage i + 1:
+	 * pipes[i][0] -> Read end
+	 * pipes[i][1] -> Write end
+	 * They're all O_CLOEXEC, so a stage only keeps what it dup2()s, and the parent closes
+	 * every pipe end once the stages are running: each reader sees EOF when its writer exits.
+	 * In a fan-out there's no pipe between the last stage of a pipeline and the first of the next one,
+	 * the producer writes into the shell, which writes into the consumers (see Fanout).
+	 */
+
+	const int n = line->ncommands;
+	int pipes[n][2];
+	int plan[n][STAGE_FDS];
+
+	for (int i = 0; i < n - 1; i++) {
+		if (_consumer_at(line, i + 1) != -1) {
+			pipes[i][0] = pipes[i][1] = -1;
+			continue;
+		}
+		if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+			perror("pipe2");
+			for (int j = 0; j < i; j++) { close(pipes[j][0]); close(pipes[j][1]); }
+			for (int k = 0; k < 3; k++) {
+				if (redirect[k] > STDERR_FILENO) close(redirect[k]);
+			}
+			if (capture[0] != -1) { close(capture[0]); close(capture[1]); }
+			return 1;
+		}
+	}
+
+	int ends[line->nconsumers + 1]; // producer's stdout, then the stdin of each consumer
+	Fanout *fanout = NULL;
+	if (line->nconsumers > 0 && (fanout = fanout_open(line->nconsumers, ends)) == NULL) {
+		for (int i = 0; i < n - 1; i++) { close(pipes[i][0]); close(pipes[i][1]); }
+		for (int k = 0; k < 3; k++) {
+			if (redirect[k] > STDERR_FILENO) close(redirect[k]);
+		}
+		if (capture[0] != -1) { close(capture[0]); close(capture[1]); }
+		return 1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		const int last = i == n - 1 || _consumer_at(line, i + 1) != -1; // of its pipeline
+		const int consumer = _consumer_at(line, i);
+
+		// stdin: input redirection for the first one, read end of the previous pipe for the rest
+		if (i == 0) plan[i][0] = redirect[0];
+		else plan[i][0] = consumer != -1 ? ends[consumer + 1] : pipes[i - 1][0];
+
+		// stdout: write end of the pipe, except for the last one
+		// captured jobs write stderr of every stage and stdout of the last one into the capture pipe
+		if (!last) plan[i][1] = pipes[i][1];
+		else if (fanout != NULL && i + 1 == line->consumers[0]) plan[i][1] = ends[0];
+		else if (output != NULL) plan[i][1] = redirect[1];
+		else plan[i][1] = capture[1] != -1 ? capture[1] : fileno(stdout);
+
+		if (last && error != NULL) plan[i][2] = redirect[2];
+		else plan[i][2] = capture[1] != -1 ? capture[1] : STDERR_FILENO;
+
+		for (int k = 3; k < STAGE_FDS; k++) plan[i][k] = FD_UNSET;
+	}
+
+	int files[line->nredirects + 1];
+	int nfiles = 0;
+	if (_plan_redirects(line, plan, files, &nfiles) == -1) {
+		for (int k = 0; k < nfiles; k++) close(files[k]);
+		for (int i = 0; i < n - 1; i++) { close(pipes[i][0]); close(pipes[i][1]); }
+		if (capture[0] != -1) { close(capture[0]); close(capture[1]); }
+		if (fanout != NULL) {
+			for (int k = 0; k <= line->nconsumers; k++) close(ends[k]);
+			fanout_free(fanout);
+		}
+		return 1;
+	}
+
+	fflush(stdout); // builtin output written so far goes before the children's
+	Job *job = add_job(line, cmd);
+	const int job_id = job->id;
+	job->fanout = fanout;
+	job->running = n; // the zygote may report a stage that exited before the next one is spawned
+	if (options[OPT_PERF] || perf_next) job->counters = malloc(sizeof(Counters) * n);
+	perf_next = 0;
+	place_stages(job->cpus, n);
+
+	for (int i = 0; i < n; i++) {
+		Job *curr = _get_job(job_id);
+		const pid_t pid = spawn_stage(&line->commands[i], plan[i], job_control ? curr->pgid : -1,
+			curr->counters == NULL ? NULL : &curr->counters[i]);
+
+		if (pid == -1) { perror("fork"); exit(1); }
+
+		curr = _get_job(job_id);
+		if (job_control && curr->pgid == 0) curr->pgid = pid;
+		curr->pids[i] = pid;
+		pin_stage(pid, curr->cpus[i]);
+	}
+
+	for (int i = 0; i < n - 1; i++) {
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	for (int k = 0; k < 3; k++) {
+		if (redirect[k] > STDERR_FILENO) close(redirect[k]);
+	}
+	for (int k = 0; k < nfiles; k++) close(files[k]);
+	for (int k = 0; fanout != NULL && k <= line->nconsumers; k++) close(ends[k]);
+	if (capture[1] != -1) {
+		close(capture[1]);
+		fcntl(capture[0], F_SETFL, O_NONBLOCK);
+		_get_job(job_id)->capture_fd = capture[0];
+	}
+
+	if (options[OPT_FDAUDIT]) fd_audit(fds_before, cmd, _get_job(job_id));
+
+	const char *limit = var_get("JOB_TIMEOUT");
+	double seconds;
+	if (limit != NULL && parse_duration(limit, &seconds) && seconds > 0) job_set_deadline(_get_job(job_id), seconds);
+	*job_id_out = job_id;
+	return 0;
+}
+
+/*
+ * Copy fast path
+ *
+ * A foreground cat [FILE...] [< FILE] > FILE only moves bytes between files, so the shell does it
+ * without forking cat: with copy_file_range(), which lets filesystems that support it share extents
+ * instead of copying, or with sendfile() when the kernel refuses that for the two files.
+ * Whatever cat could do differently runs cat as usual: options or -, stderr redirected, an input that
+ * isn't a regular file or can't be opened, the output being one of the inputs, or any error while copying
+ * (cat then starts over, the output is truncated again and regular inputs are read from the start).
+ * So does a line that should get a deadline ($JOB_TIMEOUT) or perf counters, which only a job can have.
+ */
+
+long long copied_bytes = -1; // moved by the last pipeline that took the fast path, -1 if it didn't
+const char *copy_method = NULL; // the syscall that did it
+
+int _is_copy(const tline *line) {
+	const tcommand *cmd = &line->commands[0];
+	if (line->ncommands != 1 || line->background || line->redirect_output == NULL || line->redirect_error != NULL ||
+		line->nredirects > 0) {
+		return 0;
+	}
+	if (cmd->filename == NULL || strcmp(strrchr(cmd->filename, '/') != NULL ? strrchr(cmd->filename, '/') + 1 : cmd->filename, "cat") != 0) {
+		return 0;
+	}
+	if (cmd->argc == 1 && line->redirect_input == NULL) return 0; // reads the terminal
+
+	const char *limit = var_get("JOB_TIMEOUT");
+	double seconds;
+	if (options[OPT_PERF] || perf_next || (limit != NULL && parse_duration(limit, &seconds) && seconds > 0)) return 0;
+
+	for (int i = 1; i < cmd->argc; i++) {
+		if (cmd->argv[i][0] == '-') return 0;
+	}
+	return 1;
+}
+
+/*
+ * Appends in to out, returns the bytes copied or -1
+ */
+
+long long _copy_file(const int in, const int out, const off_t size) {
+	long long total = 0;
+	ssize_t n = -1;
+
+	// files that report no size (in /proc, /sys) are generated on read, copy_file_range() may see them empty
+	copy_method = "copy_file_range";
+	if (size > 0) {
+		while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0) total += n;
+		if (n == 0) return total;
+		if (total > 0 || (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)) return -1;
+	}
+
+	copy_method = "sendfile";
+	while ((n = sendfile(out, in, NULL, 1 << 30)) > 0) total += n;
+	return n == 0 ? total : -1;
+}
+
+/*
+ * Returns the exit status of cat, or -1 if it has to run
+ */
+
+int copy_pipeline(const tline *line) {
+	const tcommand *cmd = &line->commands[0];
+	const int nfiles = cmd->argc > 1 ? cmd->argc - 1 : 1;
+	int fds[nfiles];
+	off_t sizes[nfiles];
+	int opened = 0, ok = 1, status = -1, stdin_fd = -1;
+	struct stat st, out_st;
+
+	if (line->redirect_input != NULL) {
+		stdin_fd = open(line->redirect_input, O_RDONLY | O_CLOEXEC);
+		if (stdin_fd == -1) return -1;
+	}
+	const int out_exists = stat(line->redirect_output, &out_st) == 0;
+	for (; opened < nfiles && ok; opened++) {
+		fds[opened] = cmd->argc > 1 ? open(cmd->argv[opened + 1], O_RDONLY | O_CLOEXEC) : dup(stdin_fd);
+		ok = fds[opened] != -1 && fstat(fds[opened], &st) == 0 && S_ISREG(st.st_mode) &&
+			!(out_exists && out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino);
+		sizes[opened] = ok ? st.st_size : 0;
+	}
+
+	const int out = ok ? open(line->redirect_output, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644) : -1;
+	if (out != -1) {
+		copied_bytes = 0;
+		status = 0;
+		for (int i = 0; i < nfiles && status == 0; i++) {
+			const long long n = _copy_file(fds[i], out, sizes[i]);
+			if (n == -1) status = -1;
+			else copied_bytes += n;
+		}
+		if (status == -1) copied_bytes = -1;
+		close(out);
+	}
+
+	for (int i = 0; i < opened; i++) {
+		if (fds[i] != -1) close(fds[i]);
+	}
+	if (stdin_fd != -1) close(stdin_fd);
+	return status;
+}
+
+/*
+ * Returns the exit status of the last command (0 for background jobs)
+ */
+
+int execute_pipeline(const tline * line, char *cmd) {
+	int job_id;
+
+	if (_is_copy(line)) {
+		int status = copy_pipeline(line);
+		if (status != -1) {
+			set_pipestatus(&status, 1);
+			return status;
+		}
+	}
+
+	const int error = start_pipeline(line, cmd, &job_id);
+
+	if (error != 0) return error;
+	if (!line->background) {
+		return exit_code(wait_foreground(job_id));
+	}
+	return 0;
+}
+
+
+/*
+ * $PWD is the cached current directory, the prompt prints it without a getcwd()
+ */
+
+void update_pwd(void) {
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) != NULL) var_set("PWD", 3, cwd, 0);
+}
+
+/*
+ * Definition of cd shell builtin
+ *
+ * arg: parser.h tline object
+ * if the path provided is null, target_dir is the one inside HOME variable
+ * ~ has already been converted into user's home directory by expand_line()
+ *
+ */
+
+int cd(const tline *line) {
+	const char *home_dir = var_get("HOME");
+	const char *target_dir = line->commands[0].argv[1];
+
+	if (target_dir == NULL) {
+		if (home_dir == NULL) {
+			fprintf(stderr, "cd: $HOME not found.\n");
+			return 1;
+		}
+		target_dir = home_dir;
+	}
+
+	if (chdir(target_dir)) {
+		fprintf(stderr, "cd: %s: no such file or directory\n", target_dir);
+		return 1;
+	}
+	update_pwd();
+	return 0;
+}
+
+/*
+ * Definition of export shell builtin
+ *
+ * export                 prints the exported variables
+ * export NAME[=value]... marks them as exported, so commands get them in their environment
+ */
+
+int export(const tline *line) {
+	char **argv = line->commands[0].argv;
+
+	if (argv[1] == NULL) {
+		for (char **env = shell_envp(); *env != NULL; env++) {
+			printf("export %s\n", *env);
+		}
+		return 0;
+	}
+
+	int status = 0;
+	for (int i = 1; argv[i] != NULL; i++) {
+		const size_t len = assignment_name_len(argv[i]);
+		if (len > 0) {
+			var_set(argv[i], len, argv[i] + len + 1, 1);
+		} else if (_is_name_char(argv[i][0], 1)) {
+			var_set(argv[i], strlen(argv[i]), NULL, 1);
+		} else {
+			fprintf(stderr, "export: %s: not a valid identifier\n", argv[i]);
+			status = 1;
+		}
+	}
+	return status;
+}
+
+/*
+ * Expansion of $NAME, ${NAME}, $?, $$ and a leading ~
+ *
+ * Runs on every execution of a pipeline, after tokenizing. Words without expansions are shared with the
+ * parsed tree, expanded ones are measured first and then written with a single arena allocation.
+ */
+
+int needs_expansion(const char *word) {
+	return word != NULL && (word[0] == '~' || strchr(word, '$') != NULL);
+}
+
+/*
+ * The parser replaces every $(...) with a $(N) placeholder, N being its index in the node.
+ * While a node is expanded, current_substs holds its substitutions and their output once they've run.
+ */
+
+typedef struct Substitutions {
+	struct Node **nodes;
+	char **values;
+	int count;
+} Substitutions;
+
+Substitutions *current_substs = NULL;
+
+const char *substitution_value(int index); // runs it, see command_substitution()
+
+/*
+ * Index of the $(N) placeholder at word, -1 if it isn't one. Stores its length in *len.
+ */
+
+int substitution_index(const char *word, size_t *len) {
+	if (word[0] != '$' || word[1] != '(' || word[2] < '0' || word[2] > '9') return -1;
+
+	char *end;
+	const long index = strtol(word + 2, &end, 10);
+	if (*end != ')') return -1;
+	*len = end + 1 - word;
+	return (int) index;
+}
+
+/*
+ * Finds the value of the expansion at word[i] == '$', storing its length in the word in *consumed.
+ * num is scratch space for $? and $$.
+ */
+
+const char *_expansion_value(const char *word, size_t *consumed, char num[16]) {
+	const char *name = word + 1;
+	size_t len = 0;
+
+	if (*name == '?' || *name == '$') {
+		snprintf(num, 16, "%d", *name == '?' ? last_status : (int) getpid());
+		*consumed = 2;
+		return num;
+	}
+	const int subst = substitution_index(word, consumed);
+	if (subst >= 0) return substitution_value(subst);
+
+	if (*name == '{') {
+		name++;
+		while (_is_name_char(name[len], len == 0)) len++;
+		if (name[len] != '}') { // not an expansion, keep the $
+			*consumed = 1;
+			return "$";
+		}
+		*consumed = len + 3;
+	} else {
+		while (_is_name_char(name[len], len == 0)) len++;
+		if (len == 0) {
+			*consumed = 1;
+			return "$";
+		}
+		*consumed = len + 1;
+	}
+
+	const Symbol *sym = intern(name, len, 0);
+	return sym == NULL || sym->value == NULL ? "" : sym->value;
+}
+
+/*
+ * Writes the expansion of word into out (if it isn't NULL) and returns its length.
+ * Substitutions only run on the first pass, the second one finds their output in current_substs.
+ */
+
+size_t _expand_into(const char *word, char *out) {
+	size_t len = 0;
+	char num[16];
+
+	if (word[0] == '~' && (word[1] == '/' || word[1] == '\0')) {
+		const char *home = var_get("HOME");
+		if (home != NULL) {
+			const size_t home_len = strlen(home);
+			if (out != NULL) memcpy(out, home, home_len);
+			len += home_len;
+			word++;
+		}
+	}
+
+	while (*word != '\0') {
+		const char *dollar = strchr(word, '$');
+		const size_t plain = dollar == NULL ? strlen(word) : (size_t) (dollar - word);
+		if (out != NULL) memcpy(out + len, word, plain);
+		len += plain;
+		word += plain;
+		if (dollar == NULL) break;
+
+		size_t consumed;
+		const char *value = _expansion_value(word, &consumed, num);
+		const size_t value_len = strlen(value);
+		if (out != NULL) memcpy(out + len, value, value_len);
+		len += value_len;
+		word += consumed;
+	}
+	return len;
+}
+
+char *expand_word(Arena *arena, char *word) {
+	if (!needs_expansion(word)) return word;
+
+	const size_t len = _expand_into(word, NULL);
+	char *expanded = arena_alloc(arena, len + 1);
+	_expand_into(word, expanded);
+	expanded[len] = '\0';
+	return expanded;
+}
+
+/*
+ * PATH lookup for a command name, /bin:/usr/bin when PATH isn't set
+ */
+
+char *resolve_command(Arena *arena, const char *name) {
+	if (strchr(name, '/') != NULL) {
+		return access(name, X_OK) == 0 ? (char *) name : NULL;
+	}
+
+	const char *path = var_get("PATH");
+	if (path == NULL) path = "/bin:/usr/bin";
+	while (*path != '\0') {
+		const size_t dir_len = strcspn(path, ":");
+		char *candidate = arena_alloc(arena, dir_len + strlen(name) + 2);
+		memcpy(candidate, path, dir_len);
+		candidate[dir_len] = '/';
+		strcpy(candidate + dir_len + 1, name);
+		if (access(candidate, X_OK) == 0) return candidate;
+
+		path += dir_len;
+		if (*path == ':') path++;
+	}
+	return NULL;
+}
+
+/*
+ * Tokenizer
+ *
+ * Builds the same tline as libparser's tokenize(): words are separated by whitespace and by | < > &,
+ * which are tokens by themselves. < FILE may only come before the first |, > FILE and >& FILE only
+ * after the last one, each of them once, and a single & anywhere makes the line a background one.
+ * The line is copied once into the arena and its words are terminated in place.
+ * Redirections written without blanks between their symbols are the extended ones, which go anywhere
+ * in any stage: [N]< FILE, [N]> FILE, [N]>> FILE, &> FILE, &>> FILE, [N]>&M, [N]<&M and [N]>&- (see
+ * _take_redirects()).
+ *
+ * Delimiters are found 64 bytes at a time: a block is classified into a whitespace and a symbol
+ * bitmask, with AVX2 or SSE2 compares when the CPU has them and a table otherwise, and the token
+ * boundaries are the set bits, found with ctz.
+ */
+
+#define CHAR_SPACE 1
+#define CHAR_SYMBOL 2
+
+const unsigned char char_class[256] = {
+	['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE, ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+	[' '] = CHAR_SPACE, ['|'] = CHAR_SYMBOL, ['<'] = CHAR_SYMBOL, ['>'] = CHAR_SYMBOL, ['&'] = CHAR_SYMBOL,
+};
+
+void _classify_scalar(const char *block, unsigned long long *space, unsigned long long *symbol) {
+	unsigned long long sp = 0, sym = 0;
+	for (int i = 0; i < 64; i++) {
+		const unsigned char c = char_class[(unsigned char) block[i]];
+		sp |= (unsigned long long) (c & CHAR_SPACE) << i;
+		sym |= (unsigned long long) (c >> 1) << i;
+	}
+	*space = sp;
+	*symbol = sym;
+}
+
+#ifdef __x86_64__
+void _classify_sse2(const char *block, unsigned long long *space, unsigned long long *symbol) {
+	*space = 0;
+	*symbol = 0;
+	for (int i = 0; i < 64; i += 16) {
+		const __m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+		const __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t')); // \t \n \v \f \r are 0..4 after this
+		const __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			_mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8(4)), ctl));
+		const __m128i sym = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('|')), _mm_cmpeq_epi8(v, _mm_set1_epi8('<'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('>')), _mm_cmpeq_epi8(v, _mm_set1_epi8('&'))));
+		*space |= (unsigned long long) (unsigned) _mm_movemask_epi8(sp) << i;
+		*symbol |= (unsigned long long) (unsigned) _mm_movemask_epi8(sym) << i;
+	}
+}
+
+__attribute__((target("avx2")))
+void _classify_avx2(const char *block, unsigned long long *space, unsigned long long *symbol) {
+	*space = 0;
+	*symbol = 0;
+	for (int i = 0; i < 64; i += 32) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *) (block + i));
+		const __m256i ctl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+		const __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			_mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8(4)), ctl));
+		const __m256i sym = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&'))));
+		*space |= (unsigned long long) (unsigned) _mm256_movemask_epi8(sp) << i;
+		*symbol |= (unsigned long long) (unsigned) _mm256_movemask_epi8(sym) << i;
+	}
+}
+#endif
+
+void (*classify_block)(const char *block, unsigned long long *space, unsigned long long *symbol) = NULL;
+
+void _pick_classifier(void) {
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	classify_block = __builtin_cpu_supports("avx2") ? _classify_avx2 : _classify_sse2;
+#else
+	classify_block = _classify_scalar;
+#endif
+}
+
+typedef struct Scanner {
+	const char *text;
+	size_t len;
+	size_t base; // offset of the classified block
+	unsigned long long space; // bit i is set if text[base + i] is whitespace
+	unsigned long long symbol; // bit i is set if text[base + i] is | < > or &
+} Scanner;
+
+void _scanner_load(Scanner *scanner, const size_t base) {
+	scanner->base = base;
+	if (base + 64 <= scanner->len) {
+		classify_block(scanner->text + base, &scanner->space, &scanner->symbol);
+	} else { // the last block is padded with NULs, which are neither
+		char block[64] = {0};
+		memcpy(block, scanner->text + base, scanner->len - base);
+		classify_block(block, &scanner->space, &scanner->symbol);
+	}
+}
+
+/*
+ * Offset of the first delimiter (if delim is set) or non-whitespace at or after i, len if there is none
+ */
+
+size_t _scan(Scanner *scanner, size_t i, const int delim) {
+	while (i < scanner->len) {
+		if (i >= scanner->base + 64) _scanner_load(scanner, i & ~(size_t) 63);
+
+		unsigned long long bits = delim ? scanner->space | scanner->symbol : ~scanner->space;
+		bits &= ~0ull << (i - scanner->base);
+		if (bits != 0) {
+			const size_t at = scanner->base + __builtin_ctzll(bits);
+			return at < scanner->len ? at : scanner->len;
+		}
+		i = scanner->base + 64;
+	}
+	return scanner->len;
+}
+
+typedef struct Token {
+	size_t start;
+	size_t len;
+} Token;
+
+Token *tokens = NULL; // reused by every call
+size_t token_cap = 0;
+
+char _token_symbol(const char *line, const Token *token) {
+	return token->len == 1 && char_class[(unsigned char) line[token->start]] == CHAR_SYMBOL ? line[token->start] : '\0';
+}
+
+/*
+ * Index of the token that makes tokens[0..n) invalid, n for an unexpected end of line, -1 if it's valid
+ */
+
+long _check_tokens(const char *line, const size_t n) {
+	int input = 0, output = 0, error = 0, background = 0, piped = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const char c = _token_symbol(line, &tokens[i]);
+		const char next = i + 1 < n ? _token_symbol(line, &tokens[i + 1]) : '\0';
+		if (c == '\0') continue;
+
+		if (c != '&' && i + 1 == n) return n;
+		if (c == '>' && next == '&') { // its file is checked once the < FILE are out
+			if (error || i == 0) return i;
+			error = 1;
+		} else if (c == '&') {
+			if (i > 0 && _token_symbol(line, &tokens[i - 1]) == '>') continue;
+			if (background) return i;
+			background = 1;
+		} else {
+			if (i == 0 || (c == '<' && (input || piped)) || (c == '>' && output) || (c == '|' && (output || error))) {
+				return i;
+			}
+			if (next != '\0') return i + 1;
+			input |= c == '<';
+			output |= c == '>';
+			piped |= c == '|';
+		}
+	}
+	return -1;
+}
+
+void _token_error(const char *text, const size_t i, const size_t n) {
+	if (i >= n) {
+		fprintf(stderr, "msh: syntax error: unexpected end of line\n");
+	} else {
+		fprintf(stderr, "msh: syntax error near '%.*s'\n", (int) tokens[i].len, text + tokens[i].start);
+	}
+}
+
+
+/*
+ * Redirections of the line in the order they were written, with the offset of their first byte.
+ * filename isn't set until the words are terminated, word is its token until then.
+ */
+
+typedef struct RedirectToken {
+	size_t at;
+	Token word;
+	tredirect redirect;
+} RedirectToken;
+
+RedirectToken *redirect_tokens = NULL; // reused by every call
+size_t redirect_token_cap = 0;
+size_t redirect_token_count = 0;
+
+void _add_redirect(const size_t at, const int command, const int fd, const tredirect_type type, const Token word,
+	const int source_fd) {
+	if (redirect_token_count == redirect_token_cap) {
+		redirect_token_cap = redirect_token_cap == 0 ? 16 : redirect_token_cap * 2;
+		redirect_tokens = realloc(redirect_tokens, sizeof(RedirectToken) * redirect_token_cap);
+	}
+	redirect_tokens[redirect_token_count++] = (RedirectToken) { at, word, { command, fd, type, NULL, source_fd } };
+}
+
+Token _word_token(const char *words, const char *word) {
+	return (Token) { word - words, strlen(word) };
+}
+
+int _adjacent(const size_t i) {
+	return tokens[i].start + tokens[i].len == tokens[i + 1].start;
+}
+
+int _fd_word(const char *line, const Token *token) {
+	return token->len == 1 && line[token->start] >= '0' && line[token->start] <= '9' ? line[token->start] - '0' : -1;
+}
+
+/*
+ * Takes the extended redirections out of tokens[0..n), leaving what tokenize() knows: a single digit
+ * word right before < or > is the fd to redirect, >> appends, &> and &>> redirect stdout and stderr,
+ * and >& or <& followed by a digit (or -, to close it) makes the fd a copy of that one.
+ * >& followed by anything else is still the error redirection.
+ * Returns the number of tokens left, -1 after reporting a syntax error.
+ */
+
+long _take_redirects(const char *line, const size_t n) {
+	size_t kept = 0;
+	int command = 0;
+
+	redirect_token_count = 0;
+	for (size_t i = 0; i < n; i++) {
+		const size_t at = tokens[i].start;
+		size_t j = i;
+		int fd = -1;
+
+		if (i + 1 < n && _adjacent(i) && _fd_word(line, &tokens[i]) != -1) {
+			const char c = _token_symbol(line, &tokens[i + 1]);
+			if (c == '<' || c == '>') {
+				fd = _fd_word(line, &tokens[i]);
+				j = i + 1;
+			}
+		}
+		const char c = _token_symbol(line, &tokens[j]);
+		const char next = j + 1 < n && _adjacent(j) ? _token_symbol(line, &tokens[j + 1]) : '\0';
+		size_t k = j + 2; // the file name, if it has one
+
+		if (c == '&' && next == '>') {
+			tredirect_type type = REDIRECT_WRITE;
+			if (k < n && _adjacent(j + 1) && _token_symbol(line, &tokens[k]) == '>') {
+				type = REDIRECT_APPEND;
+				k++;
+			}
+			if (k == n || _token_symbol(line, &tokens[k]) != '\0') {
+				_token_error(line, k, n);
+				return -1;
+			}
+			_add_redirect(at, command, STDOUT_FILENO, type, tokens[k], -1);
+			_add_redirect(at, command, STDERR_FILENO, REDIRECT_DUP, (Token) { 0, 0 }, STDOUT_FILENO);
+		} else if (c == '>' && next == '>') {
+			if (k == n || _token_symbol(line, &tokens[k]) != '\0') {
+				_token_error(line, k, n);
+				return -1;
+			}
+			_add_redirect(at, command, fd == -1 ? STDOUT_FILENO : fd, REDIRECT_APPEND, tokens[k], -1);
+		} else if ((c == '>' || c == '<') && next == '&') {
+			const int dash = k < n && tokens[k].len == 1 && line[tokens[k].start] == '-';
+			const int source = k < n ? _fd_word(line, &tokens[k]) : -1;
+			if (k == n || !_adjacent(j + 1) || (source == -1 && !dash)) {
+				if (fd == -1 && c == '>') { // >& FILE
+					tokens[kept++] = tokens[i];
+					continue;
+				}
+				_token_error(line, k, n);
+				return -1;
+			}
+			if (fd == -1) fd = c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+			_add_redirect(at, command, fd, dash ? REDIRECT_CLOSE : REDIRECT_DUP, (Token) { 0, 0 }, source);
+		} else if (fd != -1) {
+			k = j + 1;
+			if (k == n || _token_symbol(line, &tokens[k]) != '\0') {
+				_token_error(line, k, n);
+				return -1;
+			}
+			_add_redirect(at, command, fd, c == '<' ? REDIRECT_READ : REDIRECT_WRITE, tokens[k], -1);
+		} else {
+			command += c == '|';
+			tokens[kept++] = tokens[i];
+			continue;
+		}
+		i = k;
+	}
+	return kept;
+}
+
+/*
+ * Returns the tline for text[0..len), NULL after reporting a syntax error
+ */
+
+tline *tokenize_line(Arena *arena, const char *text, const size_t len) {
+	if (classify_block == NULL) _pick_classifier();
+
+	Scanner scanner = { text, len, 0, 0, 0 };
+	_scanner_load(&scanner, 0);
+
+	size_t n = 0;
+	for (size_t i = _scan(&scanner, 0, 0); i < len; i = _scan(&scanner, i, 0)) {
+		if (n == token_cap) {
+			token_cap = token_cap == 0 ? 64 : token_cap * 2;
+			tokens = realloc(tokens, sizeof(Token) * token_cap);
+		}
+		const size_t end = (scanner.symbol >> (i - scanner.base)) & 1 ? i + 1 : _scan(&scanner, i, 1);
+		tokens[n++] = (Token) { i, end - i };
+		i = end;
+	}
+
+	const long left = _take_redirects(text, n);
+	if (left < 0) return NULL;
+	n = left;
+
+	const long bad = _check_tokens(text, n);
+	if (bad >= 0) {
+		_token_error(text, bad, n);
+		return NULL;
+	}
+
+	tline *line = arena_alloc(arena, sizeof(tline));
+	char *words = arena_alloc(arena, len + 1);
+	memcpy(words, text, len);
+	for (size_t i = 0; i < n; i++) {
+		if (_token_symbol(text, &tokens[i]) == '\0') words[tokens[i].start + tokens[i].len] = '\0';
+	}
+
+	// the redirections and & are taken out in three passes, like tokenize() does
+	size_t input_at = 0, output_at = 0, error_at = 0;
+	memset(line, 0, sizeof(tline));
+	for (int pass = 0; pass < 3; pass++) {
+		size_t kept = 0;
+		for (size_t i = 0; i < n; i++) {
+			const char c = _token_symbol(text, &tokens[i]);
+			if (pass == 0 && c == '<') {
+				input_at = tokens[i].start;
+				line->redirect_input = words + tokens[++i].start;
+			} else if (pass == 1 && c == '>' && _token_symbol(text, &tokens[i + 1]) == '&') {
+				if (i + 2 == n || _token_symbol(text, &tokens[i + 2]) != '\0') {
+					_token_error(text, i + 2, n);
+					return NULL;
+				}
+				error_at = tokens[i].start;
+				i += 2;
+				line->redirect_error = words + tokens[i].start;
+			} else if (pass == 1 && c == '>') {
+				output_at = tokens[i].start;
+				line->redirect_output = words + tokens[++i].start;
+			} else if (pass == 2 && c == '&') {
+				line->background = 1;
+			} else {
+				tokens[kept++] = tokens[i];
+			}
+		}
+		n = kept;
+	}
+
+	line->ncommands = n > 0;
+	for (size_t i = 0; i < n; i++) {
+		if (_token_symbol(text, &tokens[i]) != '|') continue;
+		if (i == 0 || i + 1 == n || _token_symbol(text, &tokens[i + 1]) == '|') { // only & around it
+			_token_error(text, i, n);
+			return NULL;
+		}
+		line->ncommands++;
+	}
+
+	line->commands = arena_alloc(arena, sizeof(tcommand) * line->ncommands);
+	size_t first = 0;
+	for (int c = 0; c < line->ncommands; c++) {
+		size_t last = first;
+		while (last < n && _token_symbol(text, &tokens[last]) != '|') last++;
+
+		tcommand *cmd = &line->commands[c];
+		cmd->argc = last - first;
+		cmd->argv = arena_alloc(arena, sizeof(char *) * (cmd->argc + 1));
+		for (int j = 0; j < cmd->argc; j++) cmd->argv[j] = words + tokens[first + j].start;
+		cmd->argv[cmd->argc] = NULL;
+		cmd->filename = resolve_command(arena, cmd->argv[0]);
+		first = last + 1;
+	}
+
+	if (redirect_token_count == 0) return line;
+
+	// with extended ones the list has every redirection, the order decides what 2>&1 > FILE means
+	const int last = line->ncommands - 1;
+	if (line->redirect_input != NULL) {
+		_add_redirect(input_at, 0, STDIN_FILENO, REDIRECT_READ, _word_token(words, line->redirect_input), -1);
+	}
+	if (line->redirect_output != NULL) {
+		_add_redirect(output_at, last, STDOUT_FILENO, REDIRECT_WRITE, _word_token(words, line->redirect_output), -1);
+	}
+	if (line->redirect_error != NULL) {
+		_add_redirect(error_at, last, STDERR_FILENO, REDIRECT_WRITE, _word_token(words, line->redirect_error), -1);
+	}
+	for (size_t i = 1; i < redirect_token_count; i++) {
+		const RedirectToken tmp = redirect_tokens[i];
+		size_t j = i;
+		for (; j > 0 && redirect_tokens[j - 1].at > tmp.at; j--) redirect_tokens[j] = redirect_tokens[j - 1];
+		redirect_tokens[j] = tmp;
+	}
+
+	line->nredirects = redirect_token_count;
+	line->redirects = arena_alloc(arena, sizeof(tredirect) * line->nredirects);
+	for (int i = 0; i < line->nredirects; i++) {
+		line->redirects[i] = redirect_tokens[i].redirect;
+		const tredirect_type type = line->redirects[i].type;
+		if (type == REDIRECT_DUP || type == REDIRECT_CLOSE) continue;
+		const Token word = redirect_tokens[i].word;
+		words[word.start + word.len] = '\0';
+		line->redirects[i].filename = words + word.start;
+	}
+	return line;
+}
+
+/*
+ * Glob expansion of * ? [...] and **
+ *
+ * Directories are read with getdents64 in 64 KiB batches into a DirListing. Listings are cached until
+ * the expansion of the current pipeline ends, so repeated patterns read each directory once.
+ * Pattern components without wildcards are appended without reading anything, and ** walks the tree
+ * with a thread per core. Everything is linear in the number of entries except the final sort.
+ */
+
+#define GETDENTS_BUF (64 * 1024)
+#define MAX_GLOB_THREADS 16
+
+typedef struct DirListing {
+	char *path;
+	char **names;
+	unsigned char *types; // d_type of each name
+	size_t count;
+	char *buf; // storage of the names
+} DirListing;
+
+typedef struct DirCache {
+	DirListing **slots;
+	size_t cap;
+	size_t count;
+	pthread_mutex_t lock;
+} DirCache;
+
+DirCache dir_cache = { NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct PathList {
+	char **paths;
+	size_t count;
+	size_t cap;
+} PathList;
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+void _path_push(PathList *list, char *path) {
+	if (list->count == list->cap) {
+		list->cap = list->cap == 0 ? 16 : list->cap * 2;
+		list->paths = realloc(list->paths, sizeof(char *) * list->cap);
+	}
+	list->paths[list->count++] = path;
+}
+
+void _path_free(PathList *list) {
+	for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+	free(list->paths);
+	list->paths = NULL;
+	list->count = list->cap = 0;
+}
+
+char *_path_join(const char *dir, const char *name) {
+	const size_t dir_len = strlen(dir);
+	const size_t name_len = strlen(name);
+	const int slash = dir_len > 0 && dir[dir_len - 1] != '/';
+	char *path = malloc(dir_len + slash + name_len + 1);
+
+	memcpy(path, dir, dir_len);
+	if (slash) path[dir_len] = '/';
+	memcpy(path + dir_len + slash, name, name_len + 1);
+	return path;
+}
+
+DirListing *_read_listing(const char *path) {
+	const int fd = open(*path == '\0' ? "." : path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) return NULL;
+
+	DirListing *listing = calloc(1, sizeof(DirListing));
+	size_t *offsets = NULL;
+	size_t buf_len = 0, buf_cap = 0, cap = 0;
+	char *batch = malloc(GETDENTS_BUF);
+	long n;
+
+	listing->path = strdup(path);
+	while ((n = syscall(SYS_getdents64, fd, batch, GETDENTS_BUF)) > 0) {
+		for (long off = 0; off < n; ) {
+			const struct linux_dirent64 *ent = (struct linux_dirent64 *) (batch + off);
+			off += ent->d_reclen;
+			if (ent->d_name[0] == '.' && (ent->d_name[1] == '\0' || (ent->d_name[1] == '.' && ent->d_name[2] == '\0'))) continue;
+
+			const size_t len = strlen(ent->d_name) + 1;
+			if (buf_len + len > buf_cap) {
+				buf_cap = buf_cap == 0 ? GETDENTS_BUF : buf_cap * 2;
+				if (buf_cap < buf_len + len) buf_cap = buf_len + len;
+				listing->buf = realloc(listing->buf, buf_cap);
+			}
+			if (listing->count == cap) {
+				cap = cap == 0 ? 256 : cap * 2;
+				offsets = realloc(offsets, sizeof(size_t) * cap);
+				listing->types = realloc(listing->types, cap);
+			}
+			memcpy(listing->buf + buf_len, ent->d_name, len);
+			offsets[listing->count] = buf_len;
+			listing->types[listing->count++] = ent->d_type;
+			buf_len += len;
+		}
+	}
+	close(fd);
+	free(batch);
+
+	// names point into buf only once it stopped moving
+	listing->names = malloc(sizeof(char *) * (listing->count + 1));
+	for (size_t i = 0; i < listing->count; i++) listing->names[i] = listing->buf + offsets[i];
+	free(offsets);
+	return listing;
+}
+
+void _free_listing(DirListing *listing) {
+	free(listing->path);
+	free(listing->names);
+	free(listing->types);
+	free(listing->buf);
+	free(listing);
+}
+
+DirListing **_cache_slot(const char *path) {
+	size_t i = _hash(path, strlen(path)) & (dir_cache.cap - 1);
+	while (dir_cache.slots[i] != NULL && strcmp(dir_cache.slots[i]->path, path) != 0) i = (i + 1) & (dir_cache.cap - 1);
+	return &dir_cache.slots[i];
+}
+
+/*
+ * Cached listing of path ("" is the current directory), NULL if it can't be read. Thread safe.
+ */
+
+DirListing *get_listing(const char *path) {
+	pthread_mutex_lock(&dir_cache.lock);
+	DirListing *listing = dir_cache.cap > 0 ? *_cache_slot(path) : NULL;
+	pthread_mutex_unlock(&dir_cache.lock);
+	if (listing != NULL) return listing;
+
+	listing = _read_listing(path);
+	if (listing == NULL) return NULL;
+
+	pthread_mutex_lock(&dir_cache.lock);
+	if ((dir_cache.count + 1) * 2 > dir_cache.cap) {
+		DirListing **old = dir_cache.slots;
+		const size_t old_cap = dir_cache.cap;
+		dir_cache.cap = old_cap == 0 ? 64 : old_cap * 2;
+		dir_cache.slots = calloc(dir_cache.cap, sizeof(DirListing *));
+		for (size_t i = 0; i < old_cap; i++) {
+			if (old[i] != NULL) *_cache_slot(old[i]->path) = old[i];
+		}
+		free(old);
+	}
+	DirListing **slot = _cache_slot(path);
+	if (*slot == NULL) {
+		*slot = listing;
+		dir_cache.count++;
+	} else { // another walker thread read it first
+		_free_listing(listing);
+		listing = *slot;
+	}
+	pthread_mutex_unlock(&dir_cache.lock);
+	return listing;
+}
+
+void dir_cache_clear(void) {
+	for (size_t i = 0; i < dir_cache.cap; i++) {
+		if (dir_cache.slots[i] != NULL) _free_listing(dir_cache.slots[i]);
+	}
+	free(dir_cache.slots);
+	dir_cache.slots = NULL;
+	dir_cache.cap = dir_cache.count = 0;
+}
+
+int has_glob(const char *word) {
+	return word != NULL && strpbrk(word, "*?[") != NULL;
+}
+
+/*
+ * Matches c against the class at p (just past the '['), storing where it ends in *end.
+ * Returns -1 if there is no closing ], in which case the [ is literal.
+ */
+
+int _match_class(const char *p, const unsigned char c, const char **end) {
+	const int negate = *p == '!' || *p == '^';
+	int match = 0;
+
+	if (negate) p++;
+	for (int first = 1; *p != '\0' && (*p != ']' || first); first = 0) {
+		const unsigned char lo = *p;
+		if (p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+			if (c >= lo && c <= (unsigned char) p[2]) match = 1;
+			p += 3;
+		} else {
+			if (c == lo) match = 1;
+			p++;
+		}
+	}
+	if (*p != ']') return -1;
+	*end = p + 1;
+	return match != negate;
+}
+
+/*
+ * Matches a whole name against one pattern component. Backtracks only to the last *, so it's linear
+ * in practice.
+ */
+
+int glob_match(const char *p, const char *name) {
+	const char *star_p = NULL;
+	const char *star_name = NULL;
+
+	while (*name != '\0') {
+		if (*p == '*') {
+			star_p = ++p;
+			star_name = name;
+			continue;
+		}
+		if (*p == '?') {
+			p++;
+			name++;
+			continue;
+		}
+		if (*p == '[') {
+			const char *end;
+			const int match = _match_class(p + 1, *name, &end);
+			if (match == 1) {
+				p = end;
+				name++;
+				continue;
+			}
+			if (match == -1 && *name == '[') {
+				p++;
+				name++;
+				continue;
+			}
+		} else if (*p == *name) {
+			p++;
+			name++;
+			continue;
+		}
+		if (star_p == NULL) return 0;
+		p = star_p;
+		name = ++star_name;
+	}
+	while (*p == '*') p++;
+	return *p == '\0';
+}
+
+int _is_dir(const char *dir, const char *name, const unsigned char type) {
+	if (type == DT_DIR) return 1;
+	if (type != DT_UNKNOWN && type != DT_LNK) return 0;
+
+	struct stat st;
+	char *path = _path_join(dir, name);
+	const int is_dir = stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+	free(path);
+	return is_dir;
+}
+
+/*
+ * Parallel walk for **: every directory under the roots (and the roots themselves), skipping hidden
+ * ones and without following symlinks
+ */
+
+typedef struct Walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	PathList queue;
+	PathList found;
+	int active; // workers reading a directory
+} Walk;
+
+void *_walk_worker(void *arg) {
+	Walk *walk = arg;
+
+	pthread_mutex_lock(&walk->lock);
+	while (1) {
+		while (walk->queue.count == 0 && walk->active > 0) pthread_cond_wait(&walk->cond, &walk->lock);
+		if (walk->queue.count == 0) break;
+
+		char *dir = walk->queue.paths[--walk->queue.count];
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		const DirListing *listing = get_listing(dir);
+		PathList subdirs = { 0 };
+		for (size_t i = 0; listing != NULL && i < listing->count; i++) {
+			if (listing->names[i][0] == '.') continue;
+			if (listing->types[i] == DT_DIR || (listing->types[i] == DT_UNKNOWN && _is_dir(dir, listing->names[i], DT_UNKNOWN))) {
+				_path_push(&subdirs, _path_join(dir, listing->names[i]));
+			}
+		}
+
+		pthread_mutex_lock(&walk->lock);
+		_path_push(&walk->found, dir);
+		for (size_t i = 0; i < subdirs.count; i++) _path_push(&walk->queue, subdirs.paths[i]);
+		free(subdirs.paths);
+		walk->active--;
+		pthread_cond_broadcast(&walk->cond);
+	}
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+void _walk_dirs(const PathList *roots, PathList *out) {
+	Walk walk = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, { 0 }, { 0 }, 0 };
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t threads[MAX_GLOB_THREADS];
+
+	for (size_t i = 0; i < roots->count; i++) _path_push(&walk.queue, strdup(roots->paths[i]));
+
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > MAX_GLOB_THREADS) nthreads = MAX_GLOB_THREADS;
+	int started = 0;
+	for (; started < nthreads - 1; started++) { // the calling thread is one of the workers
+		if (pthread_create(&threads[started], NULL, _walk_worker, &walk) != 0) break;
+	}
+	_walk_worker(&walk);
+	for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+	*out = walk.found;
+	free(walk.queue.paths);
+	pthread_mutex_destroy(&walk.lock);
+	pthread_cond_destroy(&walk.cond);
+}
+
+int _compare_paths(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+/*
+ * Appends the paths matching pattern to out, sorted. Returns how many there were.
+ */
+
+size_t glob_word(const char *pattern, PathList *out) {
+	PathList current = { 0 };
+	const char *p = pattern;
+	int verified = 1; // every path in current is known to exist
+
+	if (*p == '/') {
+		_path_push(&current, strdup("/"));
+		while (*p == '/') p++;
+	} else {
+		_path_push(&current, strdup(""));
+	}
+
+	while (*p != '\0' && current.count > 0) {
+		const size_t len = strcspn(p, "/");
+		char component[len + 1];
+		memcpy(component, p, len);
+		component[len] = '\0';
+		p += len;
+		while (*p == '/') p++;
+		const int last = *p == '\0';
+
+		PathList next = { 0 };
+		if (!strcmp(component, "**")) {
+			PathList dirs;
+			_walk_dirs(&current, &dirs);
+			if (!last) {
+				next = dirs;
+			} else { // a trailing ** matches everything below
+				for (size_t i = 0; i < dirs.count; i++) {
+					const DirListing *listing = get_listing(dirs.paths[i]);
+					for (size_t j = 0; listing != NULL && j < listing->count; j++) {
+						if (listing->names[j][0] != '.') _path_push(&next, _path_join(dirs.paths[i], listing->names[j]));
+					}
+				}
+				_path_free(&dirs);
+			}
+			verified = 1;
+		} else if (!has_glob(component)) { // literal, nothing to read
+			for (size_t i = 0; i < current.count; i++) _path_push(&next, _path_join(current.paths[i], component));
+			verified = 0;
+		} else {
+			for (size_t i = 0; i < current.count; i++) {
+				const DirListing *listing = get_listing(current.paths[i]);
+				for (size_t j = 0; listing != NULL && j < listing->count; j++) {
+					const char *name = listing->names[j];
+					if (name[0] == '.' && component[0] != '.') continue;
+					if (!glob_match(component, name)) continue;
+					if (!last && !_is_dir(current.paths[i], name, listing->types[j])) continue;
+					_path_push(&next, _path_join(current.paths[i], name));
+				}
+			}
+			verified = 1;
+		}
+		_path_free(&current);
+		current = next;
+	}
+
+	size_t matches = 0;
+	const size_t first = out->count;
+	for (size_t i = 0; i < current.count; i++) {
+		struct stat st;
+		if (!verified && lstat(current.paths[i], &st) == -1) {
+			free(current.paths[i]);
+			continue;
+		}
+		_path_push(out, current.paths[i]);
+		matches++;
+	}
+	free(current.paths);
+
+	qsort(out->paths + first, matches, sizeof(char *), _compare_paths);
+	return matches;
+}
+
+/*
+ * Expands every word of argv ($, ~, $(...) and globs) into an arena array. Patterns without matches
+ * stay as they are, words that expand to nothing are removed, and a word that is only a $(...) is
+ * split on blanks.
+ */
+
+char **expand_argv(Arena *arena, char **argv, const int argc, int *out_argc) {
+	PathList words = { 0 }; // pointers into the arena, not owned
+
+	for (int j = 0; j < argc; j++) {
+		char *word = expand_word(arena, argv[j]);
+		size_t len;
+
+		if (substitution_index(argv[j], &len) >= 0 && argv[j][len] == '\0') {
+			for (char *field = strtok(word, " \t\n"); field != NULL; field = strtok(NULL, " \t\n")) {
+				_path_push(&words, field);
+			}
+			continue;
+		}
+		if (has_glob(word)) {
+			PathList matches = { 0 };
+			if (glob_word(word, &matches) > 0) {
+				for (size_t k = 0; k < matches.count; k++) _path_push(&words, arena_strdup(arena, matches.paths[k]));
+				_path_free(&matches);
+				continue;
+			}
+		}
+		if (word[0] != '\0' || word == argv[j]) _path_push(&words, word);
+	}
+
+	char **out = arena_alloc(arena, sizeof(char *) * (words.count + 1));
+	if (words.count > 0) memcpy(out, words.paths, sizeof(char *) * words.count);
+	out[words.count] = NULL;
+	*out_argc = (int) words.count;
+
+	free(words.paths);
+	return out;
+}
+
+/*
+ * Returns line with every word expanded, see expand_argv(). Redirections get $ and ~ but not globs.
+ */
+
+tline *expand_line(Arena *arena, const tline *src) {
+	tline *dst = arena_alloc(arena, sizeof(tline));
+
+	*dst = *src;
+	dst->redirect_input = expand_word(arena, src->redirect_input);
+	dst->redirect_output = expand_word(arena, src->redirect_output);
+	dst->redirect_error = expand_word(arena, src->redirect_error);
+	dst->commands = arena_alloc(arena, sizeof(tcommand) * src->ncommands);
+
+	// the list shares the file names of the three above, which memo() looks for
+	if (src->nredirects > 0) dst->redirects = arena_alloc(arena, sizeof(tredirect) * src->nredirects);
+	for (int i = 0; i < src->nredirects; i++) {
+		const char *filename = src->redirects[i].filename;
+		dst->redirects[i] = src->redirects[i];
+		if (filename == NULL) continue;
+		if (filename == src->redirect_input) dst->redirects[i].filename = dst->redirect_input;
+		else if (filename == src->redirect_output) dst->redirects[i].filename = dst->redirect_output;
+		else if (filename == src->redirect_error) dst->redirects[i].filename = dst->redirect_error;
+		else dst->redirects[i].filename = expand_word(arena, src->redirects[i].filename);
+	}
+
+	for (int i = 0; i < src->ncommands; i++) {
+		const tcommand *scmd = &src->commands[i];
+		tcommand *cmd = &dst->commands[i];
+
+		*cmd = *scmd;
+		cmd->argv = expand_argv(arena, scmd->argv, scmd->argc, &cmd->argc);
+
+		if (cmd->argc == 0) { // every word was empty
+			cmd->argv[cmd->argc++] = "";
+			cmd->argv[cmd->argc] = NULL;
+		}
+		if (cmd->argv[0] != scmd->argv[0]) cmd->filename = NULL; // see resolve_commands()
+	}
+	dir_cache_clear();
+	return dst;
+}
+
+/*
+ * Looks up the commands whose name changed in expand_line(), only done when the line isn't a builtin
+ */
+
+void resolve_commands(Arena *arena, tline *line, const tline *src) {
+	for (int i = 0; i < line->ncommands; i++) {
+		if (line->commands[i].argv[0] != src->commands[i].argv[0]) {
+			line->commands[i].filename = resolve_command(arena, line->commands[i].argv[0]);
+		}
+	}
+}
+
+/*
+ * dst = src without the first skip words, for builtins that run the rest of their line as a pipeline
+ */
+
+void strip_words(Arena *arena, tline *dst, const tline *src, const int skip) {
+	*dst = *src;
+	dst->commands = arena_alloc(arena, sizeof(tcommand) * src->ncommands);
+	memcpy(dst->commands, src->commands, sizeof(tcommand) * src->ncommands);
+	dst->commands[0].argv += skip;
+	dst->commands[0].argc -= skip;
+	dst->commands[0].filename = resolve_command(arena, dst->commands[0].argv[0]);
+}
+
+/*
+ * Definition of timeout shell builtin
+ *
+ * timeout DURATION pipeline   runs the pipeline with a deadline (see job_set_deadline()).
+ *                             DURATION is a number of seconds with an optional s, m, h or d suffix.
+ */
+
+int timeout(Arena *arena, const tline *line, char *command) {
+	char **argv = line->commands[0].argv;
+	double seconds;
+	int job_id;
+
+	if (argv[1] == NULL || argv[2] == NULL || !parse_duration(argv[1], &seconds)) {
+		fprintf(stderr, "timeout: usage: timeout DURATION pipeline\n");
+		return 1;
+	}
+
+	tline run;
+	strip_words(arena, &run, line, 2);
+	const int error = start_pipeline(&run, command, &job_id);
+	if (error != 0) return error;
+
+	job_set_deadline(_get_job(job_id), seconds);
+	return line->background ? 0 : exit_code(wait_foreground(job_id));
+}
+
+/*
+ * Definition of time shell builtin
+ *
+ * time pipeline      runs the pipeline and prints its real, user and sys time to stderr, and how many bytes
+ *                    it moved and how fast when the copy fast path did it
+ * time -v pipeline   also prints the perf counters of each stage (see counters_open())
+ *
+ * User and sys time add the shell's own to its children's, so a copy done in the shell still counts.
+ * Stages spawned by the zygote aren't children of the shell and only count in real time.
+ */
+
+void _print_time(const char *label, const double seconds) {
+	fprintf(stderr, "%s\t%dm%.3fs\n", label, (int) (seconds / 60), seconds - 60 * (int) (seconds / 60));
+}
+
+double _timeval_diff(const struct timeval *from, const struct timeval *to) {
+	return to->tv_sec - from->tv_sec + (to->tv_usec - from->tv_usec) / 1e6;
+}
+
+int time_builtin(Arena *arena, const tline *line, char *command) {
+	char **argv = line->commands[0].argv;
+	const int verbose = argv[1] != NULL && !strcmp(argv[1], "-v");
+
+	if (argv[1 + verbose] == NULL) {
+		fprintf(stderr, "time: usage: time [-v] pipeline\n");
+		return 1;
+	}
+
+	tline run;
+	strip_words(arena, &run, line, 1 + verbose);
+
+	struct rusage self_before, children_before, self_after, children_after;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	getrusage(RUSAGE_SELF, &self_before);
+	getrusage(RUSAGE_CHILDREN, &children_before);
+	copied_bytes = -1;
+	if (last_fanout != NULL) fanout_free(last_fanout);
+	last_fanout = NULL;
+	free(last_counters);
+	last_counters = NULL;
+	perf_next = verbose;
+
+	const int status = execute_pipeline(&run, command);
+	perf_next = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	getrusage(RUSAGE_SELF, &self_after);
+	getrusage(RUSAGE_CHILDREN, &children_after);
+	const double real = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	const double user = _timeval_diff(&self_before.ru_utime, &self_after.ru_utime) +
+		_timeval_diff(&children_before.ru_utime, &children_after.ru_utime);
+	const double sys = _timeval_diff(&self_before.ru_stime, &self_after.ru_stime) +
+		_timeval_diff(&children_before.ru_stime, &children_after.ru_stime);
+
+	fprintf(stderr, "\n");
+	_print_time("real", real);
+	_print_time("user", user);
+	_print_time("sys", sys);
+	if (copied_bytes >= 0) {
+		fprintf(stderr, "copy\t%lld bytes, %.1f MB/s (%s)\n", copied_bytes, real > 0 ? copied_bytes / real / 1e6 : 0.0,
+			copy_method);
+	}
+	if (last_fanout != NULL) print_fanout(stderr, "fanout\t", last_fanout);
+	for (int i = 0; verbose && last_counters != NULL && i < last_counters_count; i++) {
+		print_counters(stderr, "", &last_counters[i], i);
+	}
+	return status;
+}
+
+/*
+ * Definition of watch shell builtin
+ *
+ * watch PATH... -- pipeline   runs the pipeline, then again every time one of the paths changes, until Ctrl-C
+ *
+ * A file is watched through its directory, so it's still seen after an editor replaces it with a rename
+ * (or before it exists), while a directory takes any change inside it. The shell waits on the inotify fd
+ * in its event loop, nothing runs while nothing changes. A change stops the run in flight with SIGTERM and
+ * arms a WATCH_DEBOUNCE timer: what changes until it expires is part of the same burst, then the pipeline
+ * starts again (a run that ignored the SIGTERM gets SIGKILL first).
+ */
+
+#define WATCH_DEBOUNCE 100000000 // ns
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct WatchPath {
+	int wd;
+	const char *name; // in the watched directory, NULL for any
+} WatchPath;
+
+volatile sig_atomic_t watch_interrupted = 0;
+
+void _watch_sigint(int sig) {
+	const int saved_errno = errno;
+	(void) sig;
+	watch_interrupted = 1;
+	if (write(sigchld_pipe[1], "i", 1) == -1) { /* pipe full: the loop wakes up anyway */ }
+	errno = saved_errno;
+}
+
+/*
+ * Reads every pending inotify event, returns whether one is about a watched path
+ */
+
+int _watch_changed(const int fd, const WatchPath *paths, const int npaths) {
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	int changed = 0;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+			const struct inotify_event *event = (const struct inotify_event *) p;
+			for (int i = 0; i < npaths && !changed; i++) {
+				changed = paths[i].wd == event->wd &&
+					(paths[i].name == NULL || (event->len > 0 && !strcmp(paths[i].name, event->name)));
+			}
+		}
+	}
+	return changed;
+}
+
+/*
+ * Starts the pipeline with the terminal, returns its job id or -1
+ */
+
+int _watch_start(const tline *run, char *command) {
+	int job_id;
+
+	if (start_pipeline(run, command, &job_id) != 0) return -1;
+	const Job *job = _get_job(job_id);
+	if (job_control && job != NULL && job->pgid > 0) tcsetpgrp(STDIN_FILENO, job->pgid);
+	return job_id;
+}
+
+/*
+ * Waits for the job to be reaped (or stopped) and gives the terminal back, returns its exit status
+ */
+
+int _watch_finish(const int job_id) {
+	const int status = exit_code(wait_job(job_id));
+	if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+	return status;
+}
+
+int watch(Arena *arena, const tline *line, char *command) {
+	char **argv = line->commands[0].argv;
+	int sep = 1;
+
+	while (argv[sep] != NULL && strcmp(argv[sep], "--") != 0) sep++;
+	if (sep == 1 || argv[sep] == NULL || argv[sep + 1] == NULL) {
+		fprintf(stderr, "watch: usage: watch PATH... -- pipeline\n");
+		return 1;
+	}
+
+	const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		perror("watch: inotify_init1");
+		return 1;
+	}
+	const int npaths = sep - 1;
+	WatchPath paths[npaths];
+	for (int i = 0; i < npaths; i++) {
+		const char *path = argv[i + 1];
+		const char *slash = strrchr(path, '/');
+		struct stat st;
+
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+			paths[i].wd = inotify_add_watch(fd, path, WATCH_EVENTS);
+			paths[i].name = NULL;
+		} else {
+			const char *dir = slash == NULL ? "." : slash == path ? "/" : arena_strndup(arena, path, slash - path);
+			paths[i].wd = inotify_add_watch(fd, dir, WATCH_EVENTS);
+			paths[i].name = slash == NULL ? path : slash + 1;
+		}
+		if (paths[i].wd == -1) {
+			fprintf(stderr, "watch: %s: ", path);
+			perror("inotify_add_watch");
+			close(fd);
+			return 1;
+		}
+	}
+
+	tline run;
+	strip_words(arena, &run, line, sep + 1);
+	run.background = 0;
+
+	const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	const struct itimerspec debounce = { { 0, 0 }, { 0, WATCH_DEBOUNCE } };
+	struct sigaction action, saved;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = _watch_sigint; // no SA_RESTART, so poll() returns
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, &saved);
+	watch_interrupted = 0;
+
+	int status = 0;
+	int waiting = 0; // for the debounce timer
+	int job_id = _watch_start(&run, command);
+	while (!watch_interrupted && !interrupted) {
+		const Job *job = job_id == -1 ? NULL : _get_job(job_id);
+		if (job != NULL && (job->running == 0 || job->stopped == job->running)) {
+			const int stopped = job->running > 0;
+			status = _watch_finish(job_id);
+			job_id = -1;
+			if (stopped) break; // Ctrl-Z, it's a background job now
+			continue;
+		}
+		if (!event_loop_wait(waiting ? timer : fd)) continue;
+
+		if (!waiting) {
+			if (!_watch_changed(fd, paths, npaths)) continue;
+			if (job != NULL) {
+				signal_job(job, SIGTERM);
+				if (job->stopped > 0) continue_job((Job *) job);
+			}
+			waiting = timerfd_settime(timer, 0, &debounce, NULL) == 0;
+			continue;
+		}
+
+		unsigned long long expirations;
+		if (read(timer, &expirations, sizeof(expirations)) != sizeof(expirations)) continue;
+		waiting = 0;
+		_watch_changed(fd, paths, npaths); // the rest of the burst
+		if (job != NULL) {
+			signal_job(job, SIGKILL);
+			status = _watch_finish(job_id);
+		}
+		job_id = _watch_start(&run, command);
+	}
+
+	const Job *job = job_id == -1 ? NULL : _get_job(job_id);
+	if (job != NULL) {
+		signal_job(job, SIGTERM);
+		status = _watch_finish(job_id);
+	}
+	sigaction(SIGINT, &saved, NULL);
+	close(timer);
+	close(fd);
+	return status;
+}
+
+/*
+ * Definition of memo shell builtin
+ *
+ * memo [-i file]... [-e NAME]... pipeline   runs the pipeline once and replays its stdout and exit status
+ *                                           while nothing in its key changes
+ * memo -s                                   prints hit/miss stats
+ * memo -c                                   empties the cache
+ *
+ * The key hashes every argv, the program files and cwd, the -e variables, and the inode, size and mtime
+ * of the input redirection and of the -i files. Each entry is a file named after its key holding a small
+ * header with the exit status followed by the output, replayed with sendfile().
+ * Entries are touched on every hit, the least recently used ones are removed once the cache
+ * grows over $MEMO_SIZE bytes (MEMO_SIZE_DEFAULT if unset).
+ */
+
+#define MEMO_SIZE_DEFAULT (64 * 1024 * 1024)
+#define MEMO_MAGIC 0x4d454d4f // "MEMO"
+
+typedef struct MemoHeader {
+	unsigned int magic;
+	int status;
+} MemoHeader;
+
+typedef struct MemoEntry {
+	char name[32];
+	off_t size;
+	struct timespec used;
+} MemoEntry;
+
+unsigned long memo_hits = 0;
+unsigned long memo_misses = 0;
+unsigned long memo_evictions = 0;
+
+unsigned long long _hash64(unsigned long long hash, const void *data, const size_t len) {
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull; // FNV-1a
+	}
+	return hash;
+}
+
+unsigned long long _hash_string(const unsigned long long hash, const char *str) {
+	return str == NULL ? _hash64(hash, "", 1) : _hash64(hash, str, strlen(str) + 1);
+}
+
+unsigned long long _hash_file(const unsigned long long hash, const char *path) {
+	struct stat st;
+
+	if (path == NULL) return _hash64(hash, "", 1);
+	if (stat(path, &st) == -1) return _hash64(_hash_string(hash, path), &errno, sizeof(errno));
+
+	const long long id[5] = { st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+	return _hash64(_hash_string(hash, path), id, sizeof(id));
+}
+
+/*
+ * Creates the directories in path before its last component
+ */
+
+void make_parents(char *path) {
+	for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		mkdir(path, 0700);
+		*slash = '/';
+	}
+}
+
+/*
+ * $MSH_MEMO_DIR, or msh/memo under $XDG_CACHE_HOME or ~/.cache, created on first use
+ */
+
+const char *_memo_dir(void) {
+	static char dir[BUFSIZE] = { 0 };
+	const char *base;
+
+	if ((base = var_get("MSH_MEMO_DIR")) != NULL) {
+		snprintf(dir, sizeof(dir), "%s", base);
+	} else if ((base = var_get("XDG_CACHE_HOME")) != NULL) {
+		snprintf(dir, sizeof(dir), "%s/msh/memo", base);
+	} else if ((base = var_get("HOME")) != NULL) {
+		snprintf(dir, sizeof(dir), "%s/.cache/msh/memo", base);
+	} else {
+		return NULL;
+	}
+
+	make_parents(dir);
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+		fprintf(stderr, "memo: %s: ", dir);
+		perror("mkdir");
+		return NULL;
+	}
+	return dir;
+}
+
+/*
+ * Copies size bytes of in starting at offset into out, in kernel space when possible
+ */
+
+void _memo_replay(const int in, const int out, off_t offset, const off_t size) {
+	const off_t end = offset + size;
+
+	while (offset < end) {
+		const ssize_t n = sendfile(out, in, &offset, end - offset);
+		if (n > 0) continue;
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && (errno == EINVAL || errno == ENOSYS)) break; // out doesn't take sendfile()
+		return;
+	}
+
+	char buf[BUFSIZE * 16];
+	while (offset < end) {
+		const ssize_t n = pread(in, buf, (off_t) sizeof(buf) < end - offset ? (off_t) sizeof(buf) : end - offset, offset);
+		if (n <= 0 || write(out, buf, n) != n) return;
+		offset += n;
+	}
+}
+
+int _compare_used(const void *a, const void *b) {
+	const struct timespec *x = &((const MemoEntry *) a)->used;
+	const struct timespec *y = &((const MemoEntry *) b)->used;
+	if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+	return x->tv_nsec < y->tv_nsec ? -1 : x->tv_nsec > y->tv_nsec;
+}
+
+/*
+ * Removes the least recently used entries until the cache fits in max bytes (everything if max is 0)
+ */
+
+void _memo_trim(const char *dir, const off_t max) {
+	DIR *d = opendir(dir);
+	MemoEntry *entries = NULL;
+	size_t count = 0, cap = 0;
+	off_t total = 0;
+	struct dirent *ent;
+
+	if (d == NULL) return;
+	while ((ent = readdir(d)) != NULL) {
+		struct stat st;
+		if (ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(entries->name)) continue;
+		if (fstatat(dirfd(d), ent->d_name, &st, 0) == -1 || !S_ISREG(st.st_mode)) continue;
+
+		if (count == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			entries = realloc(entries, sizeof(MemoEntry) * cap);
+		}
+		strcpy(entries[count].name, ent->d_name);
+		entries[count].size = st.st_size;
+		entries[count].used = st.st_mtim;
+		total += st.st_size;
+		count++;
+	}
+
+	if (total > max) {
+		qsort(entries, count, sizeof(MemoEntry), _compare_used);
+		for (size_t i = 0; i < count && total > max; i++) {
+			if (unlinkat(dirfd(d), entries[i].name, 0) == 0) {
+				total -= entries[i].size;
+				memo_evictions++;
+			}
+		}
+	}
+	closedir(d);
+	free(entries);
+}
+
+int memo(Arena *arena, const tline *line, char *command) {
+	char **argv = line->commands[0].argv;
+	const char *dir = _memo_dir();
+	unsigned long long key = 14695981039346656037ull;
+	int skip = 1;
+
+	if (argv[1] != NULL && (!strcmp(argv[1], "-s") || !strcmp(argv[1], "-c"))) {
+		if (argv[1][1] == 'c' && dir != NULL) _memo_trim(dir, 0);
+		else printf("memo: %lu hits, %lu misses, %lu evicted\n", memo_hits, memo_misses, memo_evictions);
+		return 0;
+	}
+
+	for (; argv[skip] != NULL && argv[skip + 1] != NULL; skip += 2) {
+		if (!strcmp(argv[skip], "-i")) key = _hash_file(key, argv[skip + 1]);
+		else if (!strcmp(argv[skip], "-e")) key = _hash_string(_hash_string(key, argv[skip + 1]), var_get(argv[skip + 1]));
+		else break;
+	}
+	if (argv[skip] == NULL || line->background) {
+		fprintf(stderr, "memo: usage: memo [-i file]... [-e NAME]... pipeline\n");
+		return 1;
+	}
+
+	// the pipeline without the memo words, its output goes to the entry and is replayed from there
+	tline run;
+	strip_words(arena, &run, line, skip);
+	if (dir == NULL) return execute_pipeline(&run, command);
+	run.redirect_output = NULL;
+
+	char cwd[BUFSIZE];
+	key = _hash_string(key, getcwd(cwd, sizeof(cwd)));
+	key = _hash_file(key, line->redirect_input);
+	key = _hash_string(key, line->redirect_error);
+
+	// same for a > FILE in the redirection list, the rest go into the key
+	run.redirects = line->nredirects > 0 ? arena_alloc(arena, sizeof(tredirect) * line->nredirects) : NULL;
+	run.nredirects = 0;
+	for (int i = 0; i < line->nredirects; i++) {
+		const tredirect *r = &line->redirects[i];
+		if (r->filename != NULL && r->filename == line->redirect_output) continue;
+		run.redirects[run.nredirects++] = *r;
+		const int shape[4] = { r->command, r->fd, r->type, r->source_fd };
+		key = _hash64(key, shape, sizeof(shape));
+		key = r->type == REDIRECT_READ ? _hash_file(key, r->filename) : _hash_string(key, r->filename);
+	}
+	for (int i = 0; i < run.ncommands; i++) {
+		key = _hash_file(key, run.commands[i].filename);
+		for (int j = 0; j < run.commands[i].argc; j++) key = _hash_string(key, run.commands[i].argv[j]);
+	}
+
+	char path[BUFSIZE];
+	snprintf(path, sizeof(path), "%s/%016llx", dir, key);
+
+	const int out = line->redirect_output == NULL ? fileno(stdout) :
+		open(line->redirect_output, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+	if (out == -1) {
+		fprintf(stderr, "%s: Error. ", line->redirect_output);
+		perror("open");
+		return 1;
+	}
+	fflush(stdout);
+
+	MemoHeader header;
+	struct stat st;
+	FILE *entry = NULL;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd != -1 && pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == MEMO_MAGIC &&
+		fstat(fd, &st) == 0) {
+		memo_hits++;
+		futimens(fd, NULL); // most recently used
+		_memo_replay(fd, out, sizeof(header), st.st_size - sizeof(header));
+	} else {
+		if (fd != -1) close(fd);
+		memo_misses++;
+
+		char template[BUFSIZE];
+		snprintf(template, sizeof(template), "%s/.new-XXXXXX", dir);
+		header.magic = 0; // invalid until the pipeline finishes
+		header.status = 0;
+		fd = mkostemp(template, O_CLOEXEC);
+		if (fd != -1 && write(fd, &header, sizeof(header)) == sizeof(header)) entry = fdopen(fd, "w");
+		if (entry == NULL) {
+			perror("memo");
+			if (fd != -1) { close(fd); unlink(template); }
+			if (line->redirect_output != NULL) close(out);
+			return 1;
+		}
+
+		// the pipeline writes after the header, through stdout like the commands of a substitution
+		FILE *terminal = stdout;
+		stdout = entry;
+		header.status = execute_pipeline(&run, command);
+		fflush(entry);
+		stdout = terminal;
+
+		fstat(fd, &st);
+		_memo_replay(fd, out, sizeof(header), st.st_size - sizeof(header));
+
+		// interrupted runs and commands that weren't found aren't worth remembering
+		header.magic = MEMO_MAGIC;
+		if (!interrupted && header.status != 127 && pwrite(fd, &header, sizeof(header), 0) == sizeof(header)) {
+			rename(template, path);
+			const char *size = var_get("MEMO_SIZE");
+			_memo_trim(dir, size != NULL ? atoll(size) : MEMO_SIZE_DEFAULT);
+		} else {
+			unlink(template);
+		}
+	}
+	if (entry != NULL) fclose(entry);
+	else close(fd);
+	if (line->redirect_output != NULL) close(out);
+	return header.status;
+}
+
+/*
+ * Definition of run shell builtin
+ *
+ * run [-j N] file [task...]   runs the tasks of file (all of them if none is given) and their dependencies,
+ *                             up to N command lines at a time (one per CPU by default)
+ *
+ * Task file:
+ *
+ *   # comment
+ *   name: dep dep...
+ *   	< input files...
+ *   	> output files...
+ *   	command line
+ *   	command line
+ *
+ * Indented lines belong to the task above them. Its command lines run one after the other, a task
+ * starts once all its dependencies succeeded. A task whose outputs all exist and are newer than its inputs
+ * is skipped, unless one of its dependencies had to run. Commands go through start_pipeline(), the same
+ * spawn path as the prompt, and the scheduler waits in the event loop.
+ * Free slots take the ready task with the longest chain of dependents first, and the critical path
+ * (the chain of tasks that gated the end of the run) is printed at the end.
+ */
+
+typedef enum { TASK_WAITING, TASK_RUNNING, TASK_DONE, TASK_SKIPPED, TASK_FAILED } TaskState;
+
+typedef struct Task {
+	char *name;
+	PathList deps;
+	PathList inputs;
+	PathList outputs;
+	PathList commands;
+	int *dep_index;
+	int wanted;
+	int rank; // length of the longest chain of tasks depending on this one
+	TaskState state;
+	size_t next; // next command line
+	int job_id;
+	double start;
+	double end;
+} Task;
+
+void _split_words(PathList *list, char *words) {
+	for (char *word = strtok(words, " \t\n"); word != NULL; word = strtok(NULL, " \t\n")) {
+		_path_push(list, strdup(word));
+	}
+}
+
+/*
+ * Reads the task file into *tasks, returns how many there are or -1 on error
+ */
+
+int _load_tasks(const char *file, Task **tasks) {
+	FILE *f = fopen(file, "r");
+	char *buf = NULL;
+	size_t cap = 0;
+	int count = 0, lineno = 0;
+
+	*tasks = NULL;
+	if (f == NULL) {
+		fprintf(stderr, "run: %s: ", file);
+		perror("fopen");
+		return -1;
+	}
+
+	while (getline(&buf, &cap, f) != -1) {
+		char *line = buf;
+		lineno++;
+		line[strcspn(line, "\n")] = '\0';
+
+		const int indented = *line == ' ' || *line == '\t';
+		line += strspn(line, " \t");
+		if (*line == '\0' || *line == '#') continue;
+
+		if (!indented) {
+			char *colon = strchr(line, ':');
+			if (colon == NULL) {
+				fprintf(stderr, "run: %s:%d: expected name: dependencies\n", file, lineno);
+				count = -1;
+				break;
+			}
+			*colon = '\0';
+			*tasks = realloc(*tasks, sizeof(Task) * (count + 1));
+			Task *task = &(*tasks)[count++];
+			memset(task, 0, sizeof(Task));
+			task->name = strdup(strtok(line, " \t") != NULL ? line : "");
+			_split_words(&task->deps, colon + 1);
+		} else if (count == 0) {
+			fprintf(stderr, "run: %s:%d: command outside of a task\n", file, lineno);
+			count = -1;
+			break;
+		} else if (*line == '<') {
+			_split_words(&(*tasks)[count - 1].inputs, line + 1);
+		} else if (*line == '>') {
+			_split_words(&(*tasks)[count - 1].outputs, line + 1);
+		} else {
+			_path_push(&(*tasks)[count - 1].commands, strdup(line));
+		}
+	}
+	free(buf);
+	fclose(f);
+	return count;
+}
+
+void _free_tasks(Task *tasks, const int count) {
+	for (int i = 0; i < count; i++) {
+		free(tasks[i].name);
+		_path_free(&tasks[i].deps);
+		_path_free(&tasks[i].inputs);
+		_path_free(&tasks[i].outputs);
+		_path_free(&tasks[i].commands);
+		free(tasks[i].dep_index);
+	}
+	free(tasks);
+}
+
+void _want_task(Task *tasks, const int i) {
+	if (tasks[i].wanted) return;
+	tasks[i].wanted = 1;
+	for (size_t d = 0; d < tasks[i].deps.count; d++) _want_task(tasks, tasks[i].dep_index[d]);
+}
+
+int _rank_task(Task *tasks, const int count, const int i, const int depth) {
+	if (tasks[i].rank > 0 || depth > count) return tasks[i].rank; // depth guards against cycles
+	int rank = 0;
+	for (int j = 0; j < count; j++) {
+		for (size_t d = 0; d < tasks[j].deps.count; d++) {
+			if (tasks[j].dep_index[d] == i) {
+				const int r = _rank_task(tasks, count, j, depth + 1);
+				if (r > rank) rank = r;
+			}
+		}
+	}
+	return tasks[i].rank = rank + 1;
+}
+
+/*
+ * A task is up to date when it has outputs, all of them exist, none of its dependencies ran
+ * and the oldest output is newer than every input
+ */
+
+int _task_up_to_date(const Task *tasks, const Task *task) {
+	struct timespec oldest = { 0, 0 };
+	struct stat st;
+
+	if (task->outputs.count == 0) return 0;
+	for (size_t d = 0; d < task->deps.count; d++) {
+		if (tasks[task->dep_index[d]].state == TASK_DONE) return 0;
+	}
+	for (size_t i = 0; i < task->outputs.count; i++) {
+		if (stat(task->outputs.paths[i], &st) == -1) return 0;
+		if (i == 0 || st.st_mtim.tv_sec < oldest.tv_sec ||
+			(st.st_mtim.tv_sec == oldest.tv_sec && st.st_mtim.tv_nsec < oldest.tv_nsec)) {
+			oldest = st.st_mtim;
+		}
+	}
+	for (size_t i = 0; i < task->inputs.count; i++) {
+		if (stat(task->inputs.paths[i], &st) == -1) return 0;
+		if (st.st_mtim.tv_sec > oldest.tv_sec ||
+			(st.st_mtim.tv_sec == oldest.tv_sec && st.st_mtim.tv_nsec > oldest.tv_nsec)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Starts the next command line of task, or finishes it when there are none left.
+ * Returns 1 if a command is running.
+ */
+
+int _task_step(Task *task, Arena *arena) {
+	while (task->next < task->commands.count) {
+		char *text = task->commands.paths[task->next++];
+		const ArenaMark mark = arena_mark(arena);
+		tline *parsed = tokenize_line(arena, text, strlen(text));
+		if (parsed == NULL || parsed->ncommands == 0) {
+			arena_release(arena, mark);
+			continue;
+		}
+
+		tline *line = expand_line(arena, parsed);
+		line->background = 0;
+		resolve_commands(arena, line, parsed);
+
+		const int error = start_pipeline(line, arena_strdup(arena, text), &task->job_id);
+		arena_release(arena, mark);
+		if (error == 0) return 1;
+
+		fprintf(stderr, "run: %s failed with status %d\n", task->name, error);
+		task->state = TASK_FAILED;
+		task->end = _now();
+		return 0;
+	}
+	task->state = TASK_DONE;
+	task->end = _now();
+	return 0;
+}
+
+/*
+ * Moves waiting tasks whose dependencies are settled to running, skipped or failed,
+ * as long as there are free slots. Returns the number of running tasks.
+ */
+
+int _schedule_tasks(Task *tasks, const int count, const int slots, Arena *arena) {
+	int running = 0;
+	int changed = 1;
+
+	for (int i = 0; i < count; i++) running += tasks[i].state == TASK_RUNNING;
+
+	while (changed) {
+		changed = 0;
+		int best = -1;
+
+		for (int i = 0; i < count; i++) {
+			Task *task = &tasks[i];
+			if (!task->wanted || task->state != TASK_WAITING) continue;
+
+			int ready = 1, failed = 0;
+			for (size_t d = 0; d < task->deps.count; d++) {
+				const TaskState dep = tasks[task->dep_index[d]].state;
+				if (dep == TASK_FAILED) failed = 1;
+				else if (dep != TASK_DONE && dep != TASK_SKIPPED) ready = 0;
+			}
+			if (failed) {
+				task->state = TASK_FAILED;
+				changed = 1;
+			} else if (ready && _task_up_to_date(tasks, task)) {
+				task->state = TASK_SKIPPED;
+				changed = 1;
+			} else if (ready && (best == -1 || task->rank > tasks[best].rank)) {
+				best = i;
+			}
+		}
+
+		if (best != -1 && running < slots && !interrupted) {
+			Task *task = &tasks[best];
+			task->state = TASK_RUNNING;
+			task->start = _now();
+			if (_task_step(task, arena)) running++;
+			changed = 1;
+		}
+	}
+	return running;
+}
+
+void _print_critical_path(const Task *tasks, const int count, const double start) {
+	int last = -1;
+	int chain[count];
+	int length = 0;
+	double busy = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (tasks[i].state != TASK_DONE && tasks[i].state != TASK_FAILED) continue;
+		if (tasks[i].start == 0) continue; // failed without running
+		busy += tasks[i].end - tasks[i].start;
+		if (last == -1 || tasks[i].end > tasks[last].end) last = i;
+	}
+	if (last == -1) return;
+
+	// walk back through the dependency that finished last, the one the task was waiting for
+	while (last != -1 && length < count) {
+		chain[length++] = last;
+		const Task *task = &tasks[last];
+		last = -1;
+		for (size_t d = 0; d < task->deps.count; d++) {
+			const Task *dep = &tasks[task->dep_index[d]];
+			if (dep->start != 0 && (last == -1 || dep->end > tasks[last].end)) last = task->dep_index[d];
+		}
+	}
+
+	fprintf(stderr, "run: %.2fs elapsed, %.2fs of task time\nrun: critical path", _now() - start, busy);
+	for (int i = length - 1; i >= 0; i--) {
+		const Task *task = &tasks[chain[i]];
+		fprintf(stderr, "%s %s %.2fs", i == length - 1 ? "" : " ->", task->name, task->end - task->start);
+	}
+	fprintf(stderr, "\n");
+}
+
+int run(Arena *arena, const tline *line) {
+	char **argv = line->commands[0].argv;
+	long slots = sysconf(_SC_NPROCESSORS_ONLN);
+	int first = 1;
+	Task *tasks;
+
+	if (argv[1] != NULL && !strcmp(argv[1], "-j") && argv[2] != NULL) {
+		slots = atol(argv[2]);
+		first = 3;
+	}
+	if (argv[first] == NULL || slots < 1) {
+		fprintf(stderr, "run: usage: run [-j N] file [task...]\n");
+		return 1;
+	}
+
+	const int count = _load_tasks(argv[first], &tasks);
+	if (count < 0) {
+		_free_tasks(tasks, 0);
+		return 1;
+	}
+
+	int status = 0;
+	for (int i = 0; i < count && status == 0; i++) {
+		tasks[i].dep_index = malloc(sizeof(int) * (tasks[i].deps.count + 1));
+		for (size_t d = 0; d < tasks[i].deps.count; d++) {
+			int j = 0;
+			while (j < count && strcmp(tasks[j].name, tasks[i].deps.paths[d]) != 0) j++;
+			if (j == count) {
+				fprintf(stderr, "run: %s: unknown dependency %s\n", tasks[i].name, tasks[i].deps.paths[d]);
+				status = 1;
+			}
+			tasks[i].dep_index[d] = j;
+		}
+	}
+	for (int i = first + 1; argv[i] != NULL && status == 0; i++) {
+		int j = 0;
+		while (j < count && strcmp(tasks[j].name, argv[i]) != 0) j++;
+		if (j == count) {
+			fprintf(stderr, "run: %s: no such task\n", argv[i]);
+			status = 1;
+		} else {
+			_want_task(tasks, j);
+		}
+	}
+	if (status != 0) {
+		_free_tasks(tasks, count);
+		return status;
+	}
+	for (int i = 0; i < count; i++) {
+		if (argv[first + 1] == NULL) tasks[i].wanted = 1;
+		_rank_task(tasks, count, i, 0);
+	}
+
+	const double start = _now();
+	fflush(stdout);
+	while (_schedule_tasks(tasks, count, slots, arena) > 0) {
+		event_loop_wait(-1);
+
+		for (int i = 0; i < count; i++) {
+			Job *job = tasks[i].state == TASK_RUNNING ? _get_job(tasks[i].job_id) : NULL;
+			if (job == NULL || job->running > 0) continue;
+
+			const int job_status = wait_job(tasks[i].job_id);
+			if (exit_code(job_status) != 0) {
+				fprintf(stderr, "run: %s failed with status %d\n", tasks[i].name, exit_code(job_status));
+				tasks[i].state = TASK_FAILED;
+				tasks[i].end = _now();
+			} else {
+				_task_step(&tasks[i], arena);
+			}
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (!tasks[i].wanted) continue;
+		if (tasks[i].state == TASK_FAILED || interrupted) status = 1;
+		if (tasks[i].state == TASK_WAITING && !interrupted) {
+			fprintf(stderr, "run: %s: dependency cycle\n", tasks[i].name);
+			status = 1;
+		}
+	}
+	_print_critical_path(tasks, count, start);
+	_free_tasks(tasks, count);
+	return status;
+}
+
+/*
+ * Builtins are resolved once when a line is parsed, the tree keeps the id
+ */
+
+typedef enum {
+	BUILTIN_NONE, BUILTIN_CD, BUILTIN_EXIT, BUILTIN_QUIT, BUILTIN_FG, BUILTIN_JOBS, BUILTIN_OUTPUT, BUILTIN_SET,
+	BUILTIN_TRUE, BUILTIN_FALSE, BUILTIN_COLON, BUILTIN_BREAK, BUILTIN_CONTINUE, BUILTIN_EXPORT, BUILTIN_UNSET,
+	BUILTIN_ECHO, BUILTIN_MEMO, BUILTIN_RUN, BUILTIN_TIMEOUT, BUILTIN_BG, BUILTIN_KILL, BUILTIN_TIME, BUILTIN_SOURCE,
+	BUILTIN_WATCH, BUILTIN_ASSIGN, BUILTIN_COUNT
+} Builtin;
+
+const char *builtin_names[BUILTIN_COUNT] = {
+	NULL, "cd", "exit", "quit", "fg", "jobs", "output", "set", "true", "false", ":", "break", "continue", "export",
+	"unset", "echo", "memo", "run", "timeout", "bg", "kill", "time", "source", "watch", NULL
+};
+
+/*
+ * A line made only of NAME=value words is an assignment, handled as one more builtin.
+ * Builtins that also exist as programs (echo, true...) run the program when the line has pipes,
+ * redirections or &, since most builtins ignore them. kill with a %job argument stays the builtin:
+ * the program doesn't know job specs.
+ */
+
+int _has_job_spec(const tcommand *cmd) {
+	for (int i = 1; i < cmd->argc; i++) {
+		if (cmd->argv[i][0] == '%') return 1;
+	}
+	return 0;
+}
+
+Builtin builtin_lookup(const tline *line) {
+	const tcommand *cmd = &line->commands[0];
+
+	if (line->ncommands == 1 && assignment_name_len(cmd->argv[0]) > 0) {
+		int i = 1;
+		while (i < cmd->argc && assignment_name_len(cmd->argv[i]) > 0) i++;
+		if (i == cmd->argc) return BUILTIN_ASSIGN;
+	}
+	const int plain = line->ncommands == 1 && !line->background && line->redirect_input == NULL &&
+		line->redirect_output == NULL && line->redirect_error == NULL && line->nredirects == 0;
+
+	for (int i = 1; i < BUILTIN_ASSIGN; i++) {
+		if (strcmp(cmd->argv[0], builtin_names[i]) != 0) continue;
+		// timeout, time and watch run the rest of their line as a pipeline, so they keep the pipes and redirections
+		if (!plain && cmd->filename != NULL && i != BUILTIN_TIMEOUT && i != BUILTIN_TIME && i != BUILTIN_WATCH &&
+			!(i == BUILTIN_KILL && _has_job_spec(cmd))) {
+			return BUILTIN_NONE;
+		}
+		return i;
+	}
+	return BUILTIN_NONE;
+}
+
+/*
+ * Command lists and control flow
+ *
+ * A line is parsed once into a tree of pipelines joined by ; & && || and grouped with ( ),
+ * plus if/while/until/for constructs, which may span several lines.
+ * Every pipeline is tokenized into the arena while parsing,
+ * so walking the tree (or walking a loop body again) never tokenizes it again.
+ * Groups run in the current shell, they are not subshells.
+ *
+ * list    := and_or ((';' | '&' | '\n') and_or)*
+ * and_or  := unit (('&&' | '||') unit)*
+ * unit    := '(' list ')' | if | while | for | pipeline
+ * if      := 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+ * while   := ('while' | 'until') list 'do' list 'done'
+ * for     := 'for' name ['in' word*] (';' | '\n') 'do' list 'done'
+ */
+
+typedef enum { NODE_PIPELINE, NODE_AND, NODE_OR, NODE_SEQ, NODE_GROUP, NODE_IF, NODE_WHILE, NODE_UNTIL, NODE_FOR } NodeType;
+
+typedef struct Node {
+	NodeType type;
+	struct Node *left; // AND, OR, SEQ, GROUP, condition of IF/WHILE/UNTIL, body of FOR
+	struct Node *right; // AND, OR, SEQ, then/do part of IF/WHILE/UNTIL
+	struct Node *other; // else part of IF (an IF node for elif)
+	tline *line; // PIPELINE
+	char *text; // PIPELINE, source text used as the job's command | FOR, variable name
+	Builtin builtin; // PIPELINE
+	int expand; // PIPELINE, some word has $ or ~
+	char **words; // FOR, NULL terminated
+	struct Node **substs; // PIPELINE and FOR, the $(...) of its words
+	int nsubsts;
+} Node;
+
+typedef struct Parser {
+	Arena *arena;
+	char *p;
+	int depth; // open parentheses
+	int background; // the last pipeline scanned ended with &
+	int error;
+	int incomplete; // the input ended in the middle of a construct
+} Parser;
+
+const char *keywords[] = { "then", "elif", "else", "fi", "do", "done", NULL }; // end a list
+
+Node *_parse_list(Parser *parser);
+
+Node *_new_node(Parser *parser, const NodeType type, Node *left, Node *right) {
+	Node *node = arena_alloc(parser->arena, sizeof(Node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	node->other = NULL;
+	node->line = NULL;
+	node->text = NULL;
+	node->builtin = BUILTIN_NONE;
+	node->expand = 0;
+	node->words = NULL;
+	node->substs = NULL;
+	node->nsubsts = 0;
+	return node;
+}
+
+void _syntax_error(Parser *parser) {
+	if (*parser->p == '\0') { // more lines may complete it
+		parser->incomplete = 1;
+	} else if (!parser->error) {
+		if (*parser->p == '\n') {
+			fprintf(stderr, "msh: syntax error: unexpected end of line\n");
+		} else {
+			fprintf(stderr, "msh: syntax error near '%.*s'\n", (int) strcspn(parser->p, " \t\n"), parser->p);
+		}
+	}
+	parser->error = 1;
+}
+
+void _skip_spaces(Parser *parser) {
+	while (*parser->p == ' ' || *parser->p == '\t') parser->p++;
+}
+
+void _skip_blanks(Parser *parser) {
+	while (*parser->p == ' ' || *parser->p == '\t' || *parser->p == '\n') parser->p++;
+}
+
+/*
+ * Checks if the parser is at the word kw
+ */
+
+int _at_keyword(Parser *parser, const char *kw) {
+	const size_t len = strlen(kw);
+	if (strncmp(parser->p, kw, len) != 0) return 0;
+	const char next = parser->p[len];
+	return next == '\0' || next == ' ' || next == '\t' || next == '\n' || next == ';';
+}
+
+int _expect_keyword(Parser *parser, const char *kw) {
+	_skip_blanks(parser);
+	if (!_at_keyword(parser, kw)) {
+		_syntax_error(parser);
+		return 0;
+	}
+	parser->p += strlen(kw);
+	return 1;
+}
+
+int _at_list_end(Parser *parser) {
+	for (int i = 0; keywords[i] != NULL; i++) {
+		if (_at_keyword(parser, keywords[i])) return 1;
+	}
+	return *parser->p == '\0' || *parser->p == ')';
+}
+
+/*
+ * Finds the ) closing the $( at p, NULL if the input ends first
+ */
+
+char *_substitution_end(char *p) {
+	int depth = 0;
+
+	for (p++; *p != '\0'; p++) {
+		if (*p == '(') depth++;
+		else if (*p == ')' && --depth == 0) return p;
+	}
+	return NULL;
+}
+
+/*
+ * Copies text[0..len) into the arena replacing each $(...) with a $(N) placeholder.
+ * The commands inside are parsed (once, like the rest of the line) into node->substs.
+ */
+
+char *_extract_substitutions(Parser *parser, Node *node, const char *text, const size_t len) {
+	int count = 0;
+	for (const char *p = text; (p = strstr(p, "$(")) != NULL && p < text + len; p += 2) count++;
+	if (count == 0) return arena_strndup(parser->arena, text, len);
+
+	char *out = arena_alloc(parser->arena, len + 16 * count + 1);
+	char *o = out;
+	struct Node **substs = arena_alloc(parser->arena, sizeof(Node *) * (node->nsubsts + count));
+	if (node->nsubsts > 0) memcpy(substs, node->substs, sizeof(Node *) * node->nsubsts);
+	node->substs = substs;
+
+	for (const char *p = text; p < text + len; ) {
+		if (p[0] != '$' || p[1] != '(') {
+			*o++ = *p++;
+			continue;
+		}
+		const char *end = _substitution_end((char *) p);
+		char *inner = arena_strndup(parser->arena, p + 2, end - p - 2);
+		Parser sub = { parser->arena, inner, 0, 0, 0, 0 };
+
+		node->substs[node->nsubsts] = _parse_list(&sub);
+		if (sub.error || *sub.p != '\0') {
+			if (!sub.error || sub.incomplete) fprintf(stderr, "msh: syntax error in $(%s)\n", inner);
+			parser->error = 1;
+			return NULL;
+		}
+		o += sprintf(o, "$(%d)", node->nsubsts++);
+		p = end + 1;
+	}
+	*o = '\0';
+	return out;
+}
+
+/*
+ * Whether some word of line has $, ~ or a glob
+ */
+
+int _line_expands(const tline *line) {
+	int expand = needs_expansion(line->redirect_input) || needs_expansion(line->redirect_output) ||
+		needs_expansion(line->redirect_error);
+	for (int i = 0; i < line->nredirects && !expand; i++) expand = needs_expansion(line->redirects[i].filename);
+	for (int i = 0; i < line->ncommands && !expand; i++) {
+		for (int j = 0; j < line->commands[i].argc && !expand; j++) {
+			expand = needs_expansion(line->commands[i].argv[j]) || has_glob(line->commands[i].argv[j]);
+		}
+	}
+	return expand;
+}
+
+/*
+ * Joins the pipelines of a fan-out into one tline: the consumers' commands go after the producer's,
+ * line->consumers holds where each consumer starts, and every redirection goes into the redirection list
+ * with its stage renumbered.
+ */
+
+tline *_join_fanout(Arena *arena, tline **parts, const int nparts, const int background) {
+	tline *line = arena_alloc(arena, sizeof(tline));
+	int nredirects = 0;
+
+	memset(line, 0, sizeof(tline));
+	for (int k = 0; k < nparts; k++) {
+		const tline *part = parts[k];
+		line->ncommands += part->ncommands;
+		nredirects += part->nredirects > 0 ? part->nredirects : (part->redirect_input != NULL) +
+			(part->redirect_output != NULL) + (part->redirect_error != NULL);
+	}
+	line->background = background;
+	line->nconsumers = nparts - 1;
+	line->consumers = arena_alloc(arena, sizeof(int) * line->nconsumers);
+	line->commands = arena_alloc(arena, sizeof(tcommand) * line->ncommands);
+	line->redirects = nredirects > 0 ? arena_alloc(arena, sizeof(tredirect) * nredirects) : NULL;
+
+	int first = 0;
+	for (int k = 0; k < nparts; k++) {
+		const tline *part = parts[k];
+		const int last = first + part->ncommands - 1;
+
+		if (k > 0) line->consumers[k - 1] = first;
+		memcpy(line->commands + first, part->commands, sizeof(tcommand) * part->ncommands);
+		for (int i = 0; i < part->nredirects; i++) {
+			tredirect *r = &line->redirects[line->nredirects++];
+			*r = part->redirects[i];
+			r->command += first;
+		}
+		if (part->nredirects == 0 && part->redirect_input != NULL) {
+			line->redirects[line->nredirects++] = (tredirect) { first, STDIN_FILENO, REDIRECT_READ, part->redirect_input, -1 };
+		}
+		if (part->nredirects == 0 && part->redirect_output != NULL) {
+			line->redirects[line->nredirects++] = (tredirect) { last, STDOUT_FILENO, REDIRECT_WRITE, part->redirect_output, -1 };
+		}
+		if (part->nredirects == 0 && part->redirect_error != NULL) {
+			line->redirects[line->nredirects++] = (tredirect) { last, STDERR_FILENO, REDIRECT_WRITE, part->redirect_error, -1 };
+		}
+		first += part->ncommands;
+	}
+	return line;
+}
+
+/*
+ * producer |& { consumer, ... } [&], with p at the |& after the producer.
+ * A consumer is a pipeline too, it ends at the next , or }. The whole line runs as one job (see Fanout).
+ */
+
+Node *_parse_fanout(Parser *parser, char *start, char *p) {
+	Node *node = _new_node(parser, NODE_PIPELINE, NULL, NULL);
+	char *text_start = start;
+	char *end = p;
+	tline **parts = NULL;
+	int nparts = 0;
+
+	parser->p = p + 2;
+	_skip_spaces(parser);
+	if (*parser->p != '{') {
+		_syntax_error(parser);
+		return NULL;
+	}
+
+	while (1) {
+		while (start < end && (*start == ' ' || *start == '\t')) start++;
+		while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+		const char *text = end == start ? NULL : _extract_substitutions(parser, node, start, end - start);
+		tline *part = text == NULL ? NULL : tokenize_line(parser->arena, text, strlen(text));
+		if (part == NULL || part->ncommands == 0 || part->background) {
+			if (!parser->error && (part == NULL || part->ncommands == 0)) _syntax_error(parser);
+			else if (!parser->error) fprintf(stderr, "msh: syntax error near '&'\n");
+			parser->error = 1;
+			break;
+		}
+		parts = realloc(parts, sizeof(tline *) * (nparts + 1));
+		parts[nparts++] = part;
+		if (*parser->p == '}') break;
+
+		// the next consumer, skipping the , and } inside $(...)
+		start = end = ++parser->p;
+		while (*(end += strcspn(end, "\n$,}")) == '$') {
+			char *close = end[1] == '(' ? _substitution_end(end) : end;
+			if (close == NULL) {
+				end += strlen(end);
+				break;
+			}
+			end = close + 1;
+		}
+		parser->p = end;
+		if (*end != ',' && *end != '}') {
+			_syntax_error(parser);
+			break;
+		}
+	}
+	if (parser->error) {
+		free(parts);
+		return NULL;
+	}
+
+	parser->p++;
+	_skip_spaces(parser);
+	parser->background = parser->p[0] == '&' && parser->p[1] != '&';
+	if (parser->background) parser->p++;
+
+	node->text = arena_strndup(parser->arena, text_start, parser->p - text_start);
+	node->line = _join_fanout(parser->arena, parts, nparts, parser->background);
+	node->builtin = builtin_lookup(node->line);
+	node->expand = _line_expands(node->line);
+	free(parts);
+	return node;
+}
+
+/*
+ * Scans a pipeline up to the next ; && || ( ) or end of line.
+ * A single & ends it too, but stays in its text so tokenize_line() marks it as background.
+ * Returns NULL for an empty pipeline.
+ */
+
+Node *_parse_pipeline(Parser *parser) {
+	char *start = parser->p;
+	char *p = start;
+
+	parser->background = 0;
+	while (*(p += strcspn(p, "\n;()$&|")) != '\0' && *p != '\n' && *p != ';' && *p != '(' && *p != ')') {
+		if (p[0] == '$' && p[1] == '(') {
+			char *end = _substitution_end(p);
+			if (end == NULL) { // more lines may close it
+				parser->p = p + strlen(p);
+				_syntax_error(parser);
+				return NULL;
+			}
+			p = end + 1;
+			continue;
+		}
+		if ((p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|')) break;
+		if (p[0] == '|' && p[1] == '&') return _parse_fanout(parser, start, p);
+		// >& is the error redirection, <& >&N and &> are the extended ones
+		if (p[0] == '&' && (p == start || (p[-1] != '>' && p[-1] != '<')) && p[1] != '>') {
+			parser->background = 1;
+			p++;
+			break;
+		}
+		p++;
+	}
+	parser->p = p;
+
+	while (start < p && (*start == ' ' || *start == '\t')) start++;
+	while (p > start && (p[-1] == ' ' || p[-1] == '\t')) p--;
+	if (p == start) return NULL;
+
+	Node *node = _new_node(parser, NODE_PIPELINE, NULL, NULL);
+	node->text = arena_strndup(parser->arena, start, p - start);
+
+	const ArenaMark mark = arena_mark(parser->arena);
+	const char *text = _extract_substitutions(parser, node, start, p - start);
+	if (text == NULL) return NULL;
+	if (node->nsubsts == 0) { // the copy without placeholders isn't needed
+		arena_release(parser->arena, mark);
+		text = start;
+	}
+
+	tline *line = tokenize_line(parser->arena, text, node->nsubsts == 0 ? (size_t) (p - start) : strlen(text));
+	if (line == NULL) { // tokenize_line() already reported it
+		parser->error = 1;
+		return NULL;
+	}
+	if (line->ncommands == 0) return NULL;
+	node->line = line;
+	node->builtin = builtin_lookup(node->line);
+
+	node->expand = _line_expands(line);
+	return node;
+}
+
+/*
+ * Parses a list that must not be empty (the parts of if/while/for)
+ */
+
+Node *_parse_body(Parser *parser) {
+	Node *list = _parse_list(parser);
+	if (list == NULL && !parser->error) _syntax_error(parser);
+	return list;
+}
+
+Node *_parse_if(Parser *parser) {
+	Node *node = _new_node(parser, NODE_IF, NULL, NULL);
+
+	if ((node->left = _parse_body(parser)) == NULL) return NULL;
+	if (!_expect_keyword(parser, "then")) return NULL;
+	if ((node->right = _parse_body(parser)) == NULL) return NULL;
+
+	_skip_blanks(parser);
+	if (_at_keyword(parser, "elif")) {
+		parser->p += 4;
+		node->other = _parse_if(parser); // consumes the shared fi
+		return node->other == NULL ? NULL : node;
+	}
+	if (_at_keyword(parser, "else")) {
+		parser->p += 4;
+		if ((node->other = _parse_body(parser)) == NULL) return NULL;
+	}
+	return _expect_keyword(parser, "fi") ? node : NULL;
+}
+
+Node *_parse_while(Parser *parser, const NodeType type) {
+	Node *node = _new_node(parser, type, NULL, NULL);
+
+	if ((node->left = _parse_body(parser)) == NULL) return NULL;
+	if (!_expect_keyword(parser, "do")) return NULL;
+	if ((node->right = _parse_body(parser)) == NULL) return NULL;
+	return _expect_keyword(parser, "done") ? node : NULL;
+}
+
+/*
+ * Reads one word of a for header, NULL at ; or end of line
+ */
+
+char *_parse_word(Parser *parser, Node *node) {
+	char *p;
+
+	_skip_spaces(parser);
+	for (p = parser->p; *p != '\0' && strchr(" \t\n;&|()", *p) == NULL; p++) {
+		if (p[0] == '$' && p[1] == '(') {
+			char *end = _substitution_end(p);
+			if (end == NULL) {
+				parser->p = p + strlen(p);
+				_syntax_error(parser);
+				return NULL;
+			}
+			p = end;
+		}
+	}
+	if (p == parser->p) return NULL;
+
+	char *word = _extract_substitutions(parser, node, parser->p, p - parser->p);
+	parser->p = p;
+	return word;
+}
+
+Node *_parse_for(Parser *parser) {
+	Node *node = _new_node(parser, NODE_FOR, NULL, NULL);
+	char *words[BUFSIZE];
+	int nwords = 0;
+
+	if ((node->text = _parse_word(parser, node)) == NULL) {
+		_syntax_error(parser);
+		return NULL;
+	}
+	_skip_spaces(parser);
+	if (_at_keyword(parser, "in")) {
+		parser->p += 2;
+		char *word;
+		while (nwords < BUFSIZE - 1 && (word = _parse_word(parser, node)) != NULL) words[nwords++] = word;
+		if (parser->error) return NULL;
+	}
+	_skip_spaces(parser);
+	if (*parser->p == ';') parser->p++;
+	else if (*parser->p != '\n') {
+		_syntax_error(parser);
+		return NULL;
+	}
+
+	node->words = arena_alloc(parser->arena, sizeof(char *) * (nwords + 1));
+	memcpy(node->words, words, sizeof(char *) * nwords);
+	node->words[nwords] = NULL;
+
+	if (!_expect_keyword(parser, "do")) return NULL;
+	if ((node->left = _parse_body(parser)) == NULL) return NULL;
+	return _expect_keyword(parser, "done") ? node : NULL;
+}
+
+Node *_parse_unit(Parser *parser) {
+	_skip_spaces(parser);
+
+	if (*parser->p == '(') {
+		parser->p++;
+		parser->depth++;
+		Node *list = _parse_list(parser);
+		_skip_blanks(parser);
+		if (parser->error) return NULL;
+		if (*parser->p != ')' || list == NULL) {
+			_syntax_error(parser);
+			return NULL;
+		}
+		parser->p++;
+		parser->depth--;
+		return _new_node(parser, NODE_GROUP, list, NULL);
+	}
+	if (_at_keyword(parser, "if")) {
+		parser->p += 2;
+		return _parse_if(parser);
+	}
+	if (_at_keyword(parser, "while") || _at_keyword(parser, "until")) {
+		const NodeType type = parser->p[0] == 'w' ? NODE_WHILE : NODE_UNTIL;
+		parser->p += 5;
+		return _parse_while(parser, type);
+	}
+	if (_at_keyword(parser, "for")) {
+		parser->p += 3;
+		return _parse_for(parser);
+	}
+	return _parse_pipeline(parser);
+}
+
+Node *_parse_and_or(Parser *parser) {
+	Node *left = _parse_unit(parser);
+
+	while (!parser->error && left != NULL) {
+		_skip_spaces(parser);
+		NodeType type;
+		if (parser->p[0] == '&' && parser->p[1] == '&') type = NODE_AND;
+		else if (parser->p[0] == '|' && parser->p[1] == '|') type = NODE_OR;
+		else break;
+
+		parser->p += 2;
+		_skip_blanks(parser);
+		Node *right = _at_list_end(parser) ? NULL : _parse_unit(parser);
+		if (right == NULL) {
+			_syntax_error(parser);
+			return NULL;
+		}
+		left = _new_node(parser, type, left, right);
+	}
+	return left;
+}
+
+Node *_parse_list(Parser *parser) {
+	Node *list = NULL;
+
+	_skip_blanks(parser);
+	while (!parser->error && !_at_list_end(parser)) {
+		Node *node = _parse_and_or(parser);
+		if (parser->error) return NULL;
+		if (node != NULL) list = list == NULL ? node : _new_node(parser, NODE_SEQ, list, node);
+
+		_skip_spaces(parser);
+		if (*parser->p == ';' || *parser->p == '\n') {
+			parser->p++;
+		} else if (!(parser->background && node != NULL)) {
+			// a pipeline ending with a background & is also separated from the next one
+			break;
+		}
+		_skip_blanks(parser);
+	}
+
+	if (parser->error) return NULL;
+	if (parser->depth == 0 && *parser->p == ')') _syntax_error(parser);
+	else if (parser->depth > 0 && *parser->p == '\0') _syntax_error(parser);
+	else if (!_at_list_end(parser)) _syntax_error(parser);
+	return parser->error ? NULL : list;
+}
+
+/*
+ * Parses a whole input, returns NULL if it's empty or has a syntax error.
+ * *incomplete is set when the input ends inside a construct and more lines are needed.
+ */
+
+Node *parse_line(Arena *arena, char *buf, int *incomplete) {
+	Parser parser = { arena, buf, 0, 0, 0, 0 };
+	Node *root = _parse_list(&parser);
+
+	if (!parser.error && *parser.p != '\0') { // a keyword out of place
+		_syntax_error(&parser);
+		root = NULL;
+	}
+	*incomplete = parser.incomplete;
+	return root;
+}
+
+
+/*
+ * For each command in ncommands
+ * Check if it is a builtin and call the function
+ * Else call execute_command(command[i])
+ * Returns the exit status
+ *
+ */
+
+typedef enum { LOOP_NONE, LOOP_BREAK, LOOP_CONTINUE } LoopControl;
+
+LoopControl loop_control = LOOP_NONE;
+int loop_depth = 0;
+Arena line_arena = { NULL, NULL }; // parsed tree of the current input, plus expansions while they're used
+int source(const tline *line); // runs a tree, defined after eval_node()
+
+int run_builtin(const Builtin builtin, const tline *line, char *command) {
+	switch (builtin) {
+		case BUILTIN_CD:
+			return cd(line);
+		case BUILTIN_EXIT:
+		case BUILTIN_QUIT:
+			if (current_script != NULL) script_exit();
+			if (job_count > 0) {
+				printf("There are running jobs, are you sure? (y/n): ");
+				fflush(stdout);
+				const char *answer = read_line();
+				if (answer != NULL && answer[0] == 'n') return 1;
+				free(jobs);
+			}
+			exit(last_status);
+		case BUILTIN_FG:
+			return fg(job_arg(line->commands[0].argv[1]));
+		case BUILTIN_BG:
+			return bg(job_arg(line->commands[0].argv[1]));
+		case BUILTIN_KILL:
+			return kill_builtin(line);
+		case BUILTIN_JOBS:
+			print_jobs(line->commands[0].argv[1] != NULL && !strcmp(line->commands[0].argv[1], "-l"));
+			return 0;
+		case BUILTIN_OUTPUT:
+			return output(line);
+		case BUILTIN_SET:
+			return set(line);
+		case BUILTIN_EXPORT:
+			return export(line);
+		case BUILTIN_UNSET:
+			for (int i = 1; line->commands[0].argv[i] != NULL; i++) var_unset(line->commands[0].argv[i]);
+			return 0;
+		case BUILTIN_ASSIGN:
+			for (int i = 0; i < line->commands[0].argc; i++) {
+				const char *word = line->commands[0].argv[i];
+				const size_t len = assignment_name_len(word);
+				var_set(word, len, word + len + 1, 0);
+			}
+			return 0;
+		case BUILTIN_MEMO:
+			return memo(&line_arena, line, command);
+		case BUILTIN_RUN:
+			return run(&line_arena, line);
+		case BUILTIN_TIMEOUT:
+			return timeout(&line_arena, line, command);
+		case BUILTIN_TIME:
+			return time_builtin(&line_arena, line, command);
+		case BUILTIN_SOURCE:
+			return source(line);
+		case BUILTIN_WATCH:
+			return watch(&line_arena, line, command);
+		case BUILTIN_ECHO: {
+			char **argv = line->commands[0].argv;
+			const int newline = argv[1] == NULL || strcmp(argv[1], "-n") != 0;
+			for (int i = newline ? 1 : 2; argv[i] != NULL; i++) {
+				fputs(argv[i], stdout);
+				if (argv[i + 1] != NULL) putchar(' ');
+			}
+			if (newline) putchar('\n');
+			return 0;
+		}
+		case BUILTIN_TRUE:
+		case BUILTIN_COLON:
+			return 0;
+		case BUILTIN_FALSE:
+			return 1;
+		case BUILTIN_BREAK:
+		case BUILTIN_CONTINUE:
+			if (loop_depth == 0) {
+				fprintf(stderr, "%s: only meaningful in a loop\n", builtin_names[builtin]);
+				return 1;
+			}
+			loop_control = builtin == BUILTIN_BREAK ? LOOP_BREAK : LOOP_CONTINUE;
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+int eval(const tline * line, char * command) {
+	const Builtin builtin = builtin_lookup(line);
+
+	if (builtin != BUILTIN_NONE) {
+		return run_builtin(builtin, line, command);
+	}
+	return execute_pipeline(line, command);
+}
+
+int _stop_list(void) {
+	return loop_control != LOOP_NONE || interrupted;
+}
+
+/*
+ * Makes the $(...) of node available to expand_word(), returns the previous ones to restore afterwards
+ */
+
+Substitutions *_begin_substitutions(Substitutions *substs, const Node *node) {
+	Substitutions *outer = current_substs;
+
+	substs->nodes = node->substs;
+	substs->count = node->nsubsts;
+	substs->values = NULL;
+	if (node->nsubsts > 0) {
+		substs->values = arena_alloc(&line_arena, sizeof(char *) * node->nsubsts);
+		memset(substs->values, 0, sizeof(char *) * node->nsubsts);
+	}
+	current_substs = substs;
+	return outer;
+}
+
+/*
+ * Walks a parsed line. && and || short-circuit on the exit status of their left side,
+ * loops run their body straight from the tree
+ */
+
+int eval_node(const Node *node) {
+	int status = 0;
+
+	switch (node->type) {
+		case NODE_PIPELINE: {
+			// expansions live in the line's arena only while the pipeline runs
+			const ArenaMark mark = arena_mark(&line_arena);
+			tline *line = node->line;
+			Builtin builtin = node->builtin;
+
+			if (node->expand) {
+				Substitutions substs;
+				Substitutions *outer = _begin_substitutions(&substs, node);
+				line = expand_line(&line_arena, node->line);
+				current_substs = outer;
+
+				if (line->commands[0].argv[0] != node->line->commands[0].argv[0]) builtin = builtin_lookup(line);
+				if (builtin == BUILTIN_NONE) resolve_commands(&line_arena, line, node->line);
+			}
+			if (builtin != BUILTIN_NONE) {
+				last_status = run_builtin(builtin, line, node->text);
+				// fg, memo, timeout, time and watch wait for a pipeline, which already set it
+				if (builtin != BUILTIN_FG && builtin != BUILTIN_MEMO && builtin != BUILTIN_TIMEOUT && builtin != BUILTIN_TIME &&
+					builtin != BUILTIN_WATCH) {
+					set_pipestatus(&last_status, 1);
+				}
+			} else {
+				last_status = execute_pipeline(line, node->text);
+			}
+			arena_release(&line_arena, mark);
+			return last_status;
+		}
+		case NODE_AND:
+			status = eval_node(node->left);
+			return status == 0 && !_stop_list() ? eval_node(node->right) : status;
+		case NODE_OR:
+			status = eval_node(node->left);
+			return status != 0 && !_stop_list() ? eval_node(node->right) : status;
+		case NODE_SEQ:
+			status = eval_node(node->left);
+			return _stop_list() ? status : eval_node(node->right);
+		case NODE_GROUP:
+			return eval_node(node->left);
+		case NODE_IF:
+			if (eval_node(node->left) == 0) {
+				if (!_stop_list()) return eval_node(node->right);
+			} else if (node->other != NULL && !_stop_list()) {
+				return eval_node(node->other);
+			}
+			return last_status = 0;
+		case NODE_WHILE:
+		case NODE_UNTIL:
+			loop_depth++;
+			while (!interrupted && (eval_node(node->left) == 0) == (node->type == NODE_WHILE) && !_stop_list()) {
+				status = eval_node(node->right);
+				if (loop_control == LOOP_BREAK) break;
+				loop_control = LOOP_NONE;
+			}
+			loop_depth--;
+			loop_control = LOOP_NONE;
+			return last_status = status;
+		case NODE_FOR: {
+			const ArenaMark mark = arena_mark(&line_arena);
+			int nwords = 0;
+			while (node->words[nwords] != NULL) nwords++;
+
+			Substitutions substs;
+			Substitutions *outer = _begin_substitutions(&substs, node);
+			char **words = expand_argv(&line_arena, node->words, nwords, &nwords);
+			current_substs = outer;
+			dir_cache_clear();
+
+			loop_depth++;
+			for (int i = 0; i < nwords && !interrupted; i++) {
+				var_set(node->text, strlen(node->text), words[i], 0);
+				status = eval_node(node->left);
+				if (loop_control == LOOP_BREAK) break;
+				loop_control = LOOP_NONE;
+			}
+			loop_depth--;
+			loop_control = LOOP_NONE;
+			arena_release(&line_arena, mark);
+			return last_status = status;
+		}
+	}
+	return last_status;
+}
+
+
+/*
+ * Definition of source shell builtin
+ *
+ * source file   runs the commands in file in the current shell, returning the status of the last one
+ *
+ * The file is mapped read-only and parsed straight from the mapping (one zero-filled page is reserved
+ * after it so it ends in a NUL). Parsed trees are kept with their mapping in SOURCE_CACHE entries keyed
+ * by device, inode, size and mtime, so sourcing the same file again, in a loop for example, only takes a
+ * stat(). An entry that is still running (a file sourcing itself, or a script yielded inside it) is
+ * never replaced.
+ */
+
+#define SOURCE_CACHE 16
+#define SOURCE_DEPTH 64
+
+typedef struct SourceFile {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	char *map; // NULL for a free entry
+	size_t map_len;
+	Arena arena;
+	Node *root; // NULL for an empty file
+	int busy;
+	unsigned long used;
+} SourceFile;
+
+SourceFile source_cache[SOURCE_CACHE];
+unsigned long source_clock = 0;
+int source_depth = 0;
+
+void _source_free(SourceFile *file) {
+	munmap(file->map, file->map_len);
+	arena_reset(&file->arena);
+	free(file->arena.head);
+	free(file->arena.spare);
+	memset(file, 0, sizeof(SourceFile));
+}
+
+/*
+ * Parses path into a free (or the least recently used idle) entry, NULL if it can't be read or parsed
+ */
+
+SourceFile *_source_load(const char *path, const struct stat *st) {
+	SourceFile *file = NULL;
+	for (int i = 0; i < SOURCE_CACHE; i++) {
+		SourceFile *entry = &source_cache[i];
+		if (entry->busy) continue;
+		if (file == NULL || entry->map == NULL || (file->map != NULL && entry->used < file->used)) file = entry;
+	}
+	if (file == NULL) {
+		fprintf(stderr, "source: %s: too many files being sourced\n", path);
+		return NULL;
+	}
+
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stderr, "source: %s: ", path);
+		perror("open");
+		return NULL;
+	}
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t map_len = (st->st_size + page) / page * page; // at least one byte past the end
+	char *map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map != MAP_FAILED && st->st_size > 0 && mmap(map, st->st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(map, map_len);
+		map = MAP_FAILED;
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "source: %s: ", path);
+		perror("mmap");
+		return NULL;
+	}
+
+	if (file->map != NULL) _source_free(file);
+	int incomplete;
+	Node *root = parse_line(&file->arena, map, &incomplete);
+	if (root == NULL && (incomplete || strspn(map, " \t\n") != (size_t) st->st_size)) {
+		if (incomplete) fprintf(stderr, "source: %s: syntax error: unexpected end of file\n", path);
+		file->map = map;
+		file->map_len = map_len;
+		_source_free(file);
+		return NULL;
+	}
+
+	file->dev = st->st_dev;
+	file->ino = st->st_ino;
+	file->size = st->st_size;
+	file->mtime = st->st_mtim;
+	file->map = map;
+	file->map_len = map_len;
+	file->root = root;
+	return file;
+}
+
+int source(const tline *line) {
+	const char *path = line->commands[0].argv[1];
+	struct stat st;
+
+	if (path == NULL) {
+		fprintf(stderr, "source: usage: source file\n");
+		return 1;
+	}
+	if (stat(path, &st) == -1) {
+		fprintf(stderr, "source: %s: no such file or directory\n", path);
+		return 1;
+	}
+	if (source_depth == SOURCE_DEPTH) {
+		fprintf(stderr, "source: %s: nested too deeply\n", path);
+		return 1;
+	}
+
+	SourceFile *file = NULL;
+	for (int i = 0; i < SOURCE_CACHE && file == NULL; i++) {
+		SourceFile *entry = &source_cache[i];
+		if (entry->map != NULL && entry->dev == st.st_dev && entry->ino == st.st_ino && entry->size == st.st_size &&
+			entry->mtime.tv_sec == st.st_mtim.tv_sec && entry->mtime.tv_nsec == st.st_mtim.tv_nsec) file = entry;
+	}
+	if (file == NULL && (file = _source_load(path, &st)) == NULL) return 1;
+	file->used = ++source_clock;
+	if (file->root == NULL) return 0;
+
+	file->busy++;
+	source_depth++;
+	const int status = eval_node(file->root);
+	source_depth--;
+	file->busy--;
+	return status;
+}
+
+/*
+ * Command substitution
+ *
+ * A tree made only of builtins runs in-process with stdout swapped for a memory stream, so there is no
+ * fork and the output lands straight in a growable buffer. Anything else runs with fd 1 on a memfd:
+ * children write into it without anyone draining a pipe meanwhile, and it's read back once the tree
+ * finishes. Trailing newlines are removed like in other shells.
+ * Either way the tree runs in the shell, so one that could change the shell's state (cd, assignments,
+ * export, unset, set, source, for) gets a copy of the variables, and its cwd and options are put back
+ * afterwards: like in a subshell, none of it is seen outside the $(...).
+ */
+
+int _changes_state(const Node *node) {
+	if (node == NULL) return 0;
+	if (node->type == NODE_FOR) return 1; // sets its variable
+
+	if (node->type == NODE_PIPELINE) {
+		switch (node->builtin) {
+			case BUILTIN_CD:
+			case BUILTIN_ASSIGN:
+			case BUILTIN_EXPORT:
+			case BUILTIN_UNSET:
+			case BUILTIN_SET:
+			case BUILTIN_SOURCE:
+				return 1;
+			default:
+				return 0;
+		}
+	}
+	return _changes_state(node->left) || _changes_state(node->right) || _changes_state(node->other);
+}
+
+typedef struct SubshellState {
+	Symbol **symbols;
+	size_t symbol_cap;
+	size_t symbol_count;
+	int options[OPT_COUNT];
+	int cwd_fd;
+} SubshellState;
+
+void free_symbols(Symbol **table, const size_t cap) {
+	for (size_t i = 0; i < cap; i++) {
+		if (table[i] == NULL) continue;
+		free(table[i]->name);
+		free(table[i]->value);
+		free(table[i]);
+	}
+	free(table);
+}
+
+void _subshell_enter(SubshellState *saved) {
+	saved->symbols = symbols;
+	saved->symbol_cap = symbol_cap;
+	saved->symbol_count = symbol_count;
+	memcpy(saved->options, options, sizeof(options));
+	saved->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+
+	symbols = calloc(symbol_cap, sizeof(Symbol *));
+	for (size_t i = 0; i < symbol_cap; i++) {
+		const Symbol *sym = saved->symbols[i];
+		if (sym == NULL) continue;
+
+		Symbol *copy = malloc(sizeof(Symbol));
+		*copy = *sym;
+		copy->name = strdup(sym->name);
+		copy->value = sym->value == NULL ? NULL : strdup(sym->value);
+		copy->value_cap = sym->value == NULL ? 0 : strlen(sym->value) + 1;
+		symbols[i] = copy;
+	}
+}
+
+void _subshell_leave(SubshellState *saved) {
+	free_symbols(symbols, symbol_cap);
+	symbols = saved->symbols;
+	symbol_cap = saved->symbol_cap;
+	symbol_count = saved->symbol_count;
+	envp_dirty = 1;
+
+	for (int i = 0; i < OPT_COUNT; i++) {
+		if (options[i] != saved->options[i]) set_option(i, saved->options[i]);
+	}
+	if (saved->cwd_fd != -1) {
+		if (fchdir(saved->cwd_fd) == -1) perror("msh: fchdir");
+		close(saved->cwd_fd);
+	}
+}
+
+int _in_process(const Node *node) {
+	if (node == NULL) return 1;
+
+	if (node->type == NODE_PIPELINE) {
+		if (node->line->ncommands > 1 || node->line->background) return 0;
+
+		switch (node->builtin) {
+			case BUILTIN_NONE: // they write to fds, not to stdout's buffer
+			case BUILTIN_OUTPUT:
+			case BUILTIN_FG:
+			case BUILTIN_MEMO:
+			case BUILTIN_RUN:
+			case BUILTIN_TIMEOUT:
+			case BUILTIN_TIME:
+			case BUILTIN_SOURCE: // may run anything
+			case BUILTIN_WATCH:
+			case BUILTIN_EXIT: // leaves the shell
+			case BUILTIN_QUIT:
+				return 0;
+			default:
+				return 1;
+		}
+	}
+	return _in_process(node->left) && _in_process(node->right) && _in_process(node->other);
+}
+
+/*
+ * Substitutions whose output is being captured, innermost first. exit inside one leaves a script
+ * without returning through command_substitution(), so script_exit() closes them with capture_unwind(),
+ * which also puts back the shell state they saved.
+ */
+
+typedef struct Capture {
+	FILE *terminal; // stdout before the capture
+	char *buf; // of open_memstream(), NULL for a memfd
+	size_t size;
+	SubshellState *saved; // shell state to put back, NULL if the tree can't change it
+	struct Capture *outer;
+} Capture;
+
+Capture *current_capture = NULL;
+
+void capture_unwind(void) {
+	while (current_capture != NULL) {
+		fclose(stdout);
+		free(current_capture->buf);
+		stdout = current_capture->terminal;
+		if (current_capture->saved != NULL) _subshell_leave(current_capture->saved);
+		current_capture = current_capture->outer;
+	}
+}
+
+char *command_substitution(Arena *arena, const Node *root) {
+	Capture capture = { stdout, NULL, 0, NULL, current_capture };
+	char *value;
+	size_t len = 0;
+
+	if (root == NULL) return "";
+	fflush(stdout);
+
+	SubshellState saved;
+	const int isolate = _changes_state(root);
+	if (isolate) {
+		_subshell_enter(&saved);
+		capture.saved = &saved;
+	}
+
+	if (_in_process(root)) {
+		FILE *file = open_memstream(&capture.buf, &capture.size);
+
+		if (file != NULL) {
+			stdout = file;
+			current_capture = &capture;
+			eval_node(root);
+			current_capture = capture.outer;
+			if (isolate) _subshell_leave(&saved);
+			fclose(file); // sets buf and size
+			stdout = capture.terminal;
+			value = arena_strndup(arena, capture.buf, capture.size);
+			len = capture.size;
+			free(capture.buf);
+			goto strip;
+		}
+	}
+
+	// commands get fileno(stdout) as their stdout, fd 1 itself is left alone
+	const int memfd = memfd_create("msh-substitution", MFD_CLOEXEC);
+	FILE *file = memfd == -1 ? NULL : fdopen(memfd, "w");
+	if (file == NULL) {
+		perror("memfd_create");
+		if (memfd != -1) close(memfd);
+		if (isolate) _subshell_leave(&saved);
+		return "";
+	}
+	stdout = file;
+	current_capture = &capture;
+	eval_node(root);
+	current_capture = capture.outer;
+	if (isolate) _subshell_leave(&saved);
+	fflush(file);
+	stdout = capture.terminal;
+
+	struct stat st;
+	if (fstat(memfd, &st) == -1) st.st_size = 0;
+	value = arena_alloc(arena, st.st_size + 1);
+	const ssize_t n = st.st_size > 0 ? pread(memfd, value, st.st_size, 0) : 0;
+	len = n > 0 ? (size_t) n : 0;
+	value[len] = '\0';
+	fclose(file);
+
+strip:
+	while (len > 0 && value[len - 1] == '\n') value[--len] = '\0';
+	return value;
+}
+
+const char *substitution_value(const int index) {
+	Substitutions *outer = current_substs;
+
+	if (outer == NULL || index >= outer->count) return "";
+	if (outer->values[index] == NULL) {
+		current_substs = NULL; // the inner tree has its own
+		outer->values[index] = command_substitution(&line_arena, outer->nodes[index]);
+		current_substs = outer;
+	}
+	return outer->values[index];
+}
+
+
+/*
+ * Prompt
+ *
+ * $PS1 is printed with these segments replaced, "msh> " while it's unset:
+ *   %d  current directory, $HOME shown as ~    %?  exit status of the last pipeline
+ *   %j  number of jobs                         %b  git branch, nothing outside a repository
+ *   %_  a space (a word can't have one)        %%  a %
+ * Printing it never waits for the filesystem: %d is $PWD, which only cd() changes, and %b is found by a
+ * worker thread, since it takes a lookup in every directory up to the repository. The prompt is printed
+ * with the last branch the worker found for the directory and printed again once it finds another.
+ */
+
+typedef struct PromptWorker {
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char *request; // directory to find the branch of, NULL while there's nothing to do
+	char *dir; // directory branch was found for
+	char branch[128];
+} PromptWorker;
+
+PromptWorker prompt_worker = { 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, "" };
+int prompt_shown = 0; // the prompt is on the terminal, waiting for a line
+
+/*
+ * Branch checked out in the git repository dir is in ("" if it isn't in one), the first 7 digits of the
+ * commit for a detached HEAD
+ */
+
+void _git_branch(const char *dir, char *branch, const size_t size) {
+	char path[PATH_MAX], head[PATH_MAX];
+	size_t len = strlen(dir);
+
+	branch[0] = '\0';
+	if (len + sizeof("/.git/HEAD") > sizeof(path)) return;
+	memcpy(path, dir, len);
+	if (len == 1) len = 0; // "/"
+
+	while (1) {
+		strcpy(path + len, "/.git/HEAD");
+		int fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) { // in a worktree or submodule .git is a file naming the real directory
+			path[len + 5] = '\0';
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd != -1) {
+				const ssize_t n = read(fd, head, sizeof(head) - 1);
+				close(fd);
+				fd = -1;
+				if (n > 8 && !memcmp(head, "gitdir: ", 8)) {
+					head[n] = '\0';
+					head[strcspn(head, "\n")] = '\0';
+					char gitdir[PATH_MAX * 2];
+					if (head[8] == '/') snprintf(gitdir, sizeof(gitdir), "%s/HEAD", head + 8);
+					else snprintf(gitdir, sizeof(gitdir), "%.*s/%s/HEAD", (int) len, path, head + 8);
+					fd = open(gitdir, O_RDONLY | O_CLOEXEC);
+				}
+			}
+		}
+		if (fd != -1) {
+			const ssize_t n = read(fd, head, sizeof(head) - 1);
+			close(fd);
+			if (n <= 0) return;
+			head[n] = '\0';
+			head[strcspn(head, "\n")] = '\0';
+			if (!strncmp(head, "ref: refs/heads/", 16)) snprintf(branch, size, "%s", head + 16);
+			else snprintf(branch, size, "%.7s", head);
+			return;
+		}
+
+		if (len == 0) return;
+		while (len > 0 && path[len - 1] != '/') len--; // up to the parent, "" being /
+		if (len > 0) len--;
+	}
+}
+
+void *_prompt_worker(void *arg) {
+	PromptWorker *worker = arg;
+	char branch[sizeof(worker->branch)];
+
+	pthread_mutex_lock(&worker->lock);
+	while (1) {
+		while (worker->request == NULL) pthread_cond_wait(&worker->cond, &worker->lock);
+		char *dir = worker->request;
+		worker->request = NULL;
+		pthread_mutex_unlock(&worker->lock);
+
+		_git_branch(dir, branch, sizeof(branch));
+
+		pthread_mutex_lock(&worker->lock);
+		const char *shown = worker->dir != NULL && !strcmp(worker->dir, dir) ? worker->branch : "";
+		const int changed = strcmp(shown, branch) != 0;
+		free(worker->dir);
+		worker->dir = dir;
+		strcpy(worker->branch, branch);
+		if (changed && write(prompt_pipe[1], "b", 1) == -1) {} // full: the main thread has yet to read it
+	}
+	return NULL;
+}
+
+/*
+ * Copies the last branch found for dir into branch. With refresh set, also asks the worker to look
+ * it up again (HEAD may have changed since).
+ */
+
+void _prompt_branch(const char *dir, char *branch, const int refresh) {
+	PromptWorker *worker = &prompt_worker;
+
+	if (!worker->started) {
+		pthread_t thread;
+		if (pipe2(prompt_pipe, O_CLOEXEC | O_NONBLOCK) == -1 || pthread_create(&thread, NULL, _prompt_worker, worker)) {
+			branch[0] = '\0';
+			return;
+		}
+		pthread_detach(thread);
+		worker->started = 1;
+	}
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->dir != NULL && !strcmp(worker->dir, dir)) strcpy(branch, worker->branch);
+	else branch[0] = '\0';
+	if (refresh) {
+		free(worker->request);
+		worker->request = strdup(dir);
+		pthread_cond_signal(&worker->cond);
+	}
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void print_prompt(const int refresh) {
+	const char *ps1 = var_get("PS1");
+	if (ps1 == NULL) {
+		fputs("msh> ", stdout);
+		return;
+	}
+
+	const char *pwd = var_get("PWD");
+	const char *home = var_get("HOME");
+	char branch[sizeof(prompt_worker.branch)];
+	if (pwd == NULL) pwd = "?";
+
+	for (const char *p = ps1; *p != '\0'; p++) {
+		if (*p != '%' || p[1] == '\0') {
+			putchar(*p);
+			continue;
+		}
+		switch (*++p) {
+		case 'd': {
+			const size_t home_len = home == NULL ? 0 : strlen(home);
+			if (home_len > 1 && !strncmp(pwd, home, home_len) && (pwd[home_len] == '/' || pwd[home_len] == '\0')) {
+				printf("~%s", pwd + home_len);
+			} else {
+				fputs(pwd, stdout);
+			}
+			break;
+		}
+		case '?':
+			printf("%d", last_status);
+			break;
+		case 'j':
+			printf("%d", job_count);
+			break;
+		case 'b':
+			_prompt_branch(pwd, branch, refresh);
+			fputs(branch, stdout);
+			break;
+		case '_':
+			putchar(' ');
+			break;
+		case '%':
+			putchar('%');
+			break;
+		default:
+			putchar('%');
+			putchar(*p);
+		}
+	}
+}
+
+/*
+ * The worker found a new branch: prints the prompt again if it's still waiting for a line. Whatever was
+ * typed after it stays in the terminal's buffer, only its echo is cleared.
+ */
+
+void prompt_repaint(void) {
+	char drain[64];
+	while (read(prompt_pipe[0], drain, sizeof(drain)) > 0) {}
+
+	if (!prompt_shown || !job_control) return; // only an interactive shell paints over its output
+	fputs("\r\033[K", stdout);
+	print_prompt(0);
+	fflush(stdout);
+}
+
+
+/*
+ * Reads the input one line at a time, running each command once it's complete
+ */
+
+typedef struct Input {
+	char *text; // lines read so far for the current command
+	size_t len;
+} Input;
+
+#ifdef MSH_SOAK
+/*
+ * Soak mode (built with -DMSH_SOAK)
+ *
+ * A long session running the same mix of commands has to reach a steady state. The heap bytes in use
+ * after each line are tracked over windows of SOAK_WINDOW lines, counting only lines after which the
+ * job table is empty (a job still in it holds memory until it's deleted). Single lines move around with
+ * the allocator, but the lowest value of a window only goes up if something leaks: once it's more than
+ * SOAK_SLACK above the one of the second window (the first is the warm-up) the shell reports it and
+ * aborts. Every window also prints its heap usage and RSS to stderr.
+ */
+
+#define SOAK_WINDOW 10000
+#define SOAK_SLACK 4096 // chunks cached by malloc (tcache) count as in use
+
+unsigned long soak_lines = 0;
+size_t soak_floor = (size_t) -1; // lowest heap use in the current window
+size_t soak_baseline = (size_t) -1; // in the second one
+
+void soak_check(void) {
+	const struct mallinfo2 info = mallinfo2();
+	const size_t in_use = info.uordblks + info.hblkhd;
+
+	soak_lines++;
+	if (job_count == 0 && in_use < soak_floor) soak_floor = in_use;
+	if (soak_lines % SOAK_WINDOW != 0) return;
+
+	long rss_pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "re");
+	if (statm != NULL) {
+		if (fscanf(statm, "%*s %ld", &rss_pages) != 1) rss_pages = 0;
+		fclose(statm);
+	}
+	fprintf(stderr, "soak: %lu lines, heap %zu bytes in use (lowest %zu), rss %ld KiB\n",
+		soak_lines, in_use, soak_floor, rss_pages * (sysconf(_SC_PAGESIZE) / 1024));
+
+	if (soak_lines > SOAK_WINDOW && soak_baseline == (size_t) -1) {
+		soak_baseline = soak_floor;
+	} else if (soak_baseline != (size_t) -1 && soak_floor != (size_t) -1 && soak_floor > soak_baseline + SOAK_SLACK) {
+		fprintf(stderr, "soak: heap grew from %zu to %zu bytes by line %lu\n", soak_baseline, soak_floor, soak_lines);
+		abort();
+	}
+	soak_floor = (size_t) -1;
+}
+#endif
+
+void feed_line(Input *input, const char *buf) {
+	const size_t len = strlen(buf);
+	input->text = realloc(input->text, input->len + len + 1);
+	memcpy(input->text + input->len, buf, len + 1);
+	input->len += len;
+
+	int incomplete;
+	arena_reset(&line_arena);
+	const Node *root = parse_line(&line_arena, input->text, &incomplete);
+
+	if (incomplete) return;
+	input->len = 0;
+	if (root == NULL) return;
+
+	interrupted = 0;
+	eval_node(root);
+#ifdef MSH_SOAK
+	soak_check();
+#endif
+}
+
+/*
+ * Startup file
+ *
+ * An interactive or stdin-fed msh runs ~/.mshrc ($MSHRC if set, nothing if it's empty) before the first
+ * line, lines starting with # being comments. Most rc files only set variables and options, so when
+ * every command in it is an assignment, export, unset or set -o without $NAME or ~ (nothing depends on
+ * the environment) the state it leaves is saved as a snapshot in msh/rc.snapshot under $XDG_CACHE_HOME or
+ * ~/.cache. Later startups whose rc file has the same mtime, size and contents mmap the snapshot and
+ * apply it, without parsing or running anything. A glob in an assignment is taken to match nothing.
+ *
+ * Layout: a SnapshotHeader, then count entries of a SnapshotVar followed by the name and the value,
+ * both NUL terminated, padded to 4 bytes.
+ */
+
+#define SNAPSHOT_MAGIC 0x504e534d // "MSNP"
+
+#define SNAP_VALUE 1 // the rc set its value (otherwise it only exported it)
+#define SNAP_UNSET 2
+#define SNAP_EXPORTED 4
+
+typedef struct SnapshotHeader {
+	unsigned int magic;
+	unsigned int noptions; // OPT_COUNT of the msh that wrote it
+	unsigned int count;
+	unsigned int size; // of the whole snapshot
+	long long rc_size;
+	long long rc_mtime[2];
+	unsigned long long rc_hash;
+	unsigned char options[OPT_COUNT];
+} SnapshotHeader;
+
+typedef struct SnapshotVar {
+	unsigned int name_len;
+	unsigned int value_len;
+	unsigned int flags;
+} SnapshotVar;
+
+#define SNAP_ALIGN(n) (((n) + 3) & ~(size_t) 3)
+
+typedef struct RcName {
+	char *name;
+	unsigned int flags; // SNAP_VALUE or SNAP_UNSET if the command sets or unsets it, 0 if it only exports it
+	size_t order;
+} RcName;
+
+typedef struct RcNames {
+	RcName *names;
+	size_t count;
+	size_t cap;
+} RcNames;
+
+void _rc_name(RcNames *names, char *name, const unsigned int flags) {
+	if (names->count == names->cap) {
+		names->cap = names->cap == 0 ? 64 : names->cap * 2;
+		names->names = realloc(names->names, sizeof(RcName) * names->cap);
+	}
+	names->names[names->count] = (RcName) { name, flags, names->count };
+	names->count++;
+}
+
+int _rc_name_cmp(const void *a, const void *b) {
+	const RcName *x = a, *y = b;
+	const int cmp = strcmp(x->name, y->name);
+	return cmp != 0 ? cmp : (x->order > y->order) - (x->order < y->order);
+}
+
+/*
+ * Whether the rc file's tree only sets variables and options, adding the names it touches to names
+ * in the order they run
+ */
+
+int _rc_cacheable(const Node *node, RcNames *names) {
+	if (node == NULL) return 1;
+	if (node->type == NODE_SEQ) return _rc_cacheable(node->left, names) && _rc_cacheable(node->right, names);
+	if (node->type != NODE_PIPELINE || node->nsubsts > 0) return 0;
+
+	const tline *line = node->line;
+	if (line->ncommands != 1 || line->background || line->redirect_input != NULL || line->redirect_output != NULL ||
+		line->redirect_error != NULL || line->nredirects > 0) return 0;
+
+	char **argv = line->commands[0].argv;
+	for (int i = 0; argv[i] != NULL; i++) {
+		if (argv[i][0] == '~' || (node->builtin != BUILTIN_ASSIGN && has_glob(argv[i]))) return 0;
+		for (const char *dollar = strchr(argv[i], '$'); dollar != NULL; dollar = strchr(dollar + 1, '$')) {
+			char num[16];
+			size_t consumed;
+			_expansion_value(dollar, &consumed, num);
+			if (consumed > 1) return 0; // a $ that isn't followed by a name stays a $
+		}
+	}
+	switch (node->builtin) {
+		case BUILTIN_ASSIGN:
+			for (int i = 0; argv[i] != NULL; i++) _rc_name(names, strndup(argv[i], assignment_name_len(argv[i])), SNAP_VALUE);
+			return 1;
+		case BUILTIN_EXPORT:
+		case BUILTIN_UNSET:
+			if (argv[1] == NULL) return 0; // export alone prints
+			for (int i = 1; argv[i] != NULL; i++) {
+				const size_t len = assignment_name_len(argv[i]);
+				if (node->builtin == BUILTIN_UNSET) _rc_name(names, strdup(argv[i]), SNAP_UNSET);
+				else _rc_name(names, len > 0 ? strndup(argv[i], len) : strdup(argv[i]), len > 0 ? SNAP_VALUE : 0);
+			}
+			return 1;
+		case BUILTIN_SET:
+			return argv[1] != NULL;
+		case BUILTIN_TRUE:
+		case BUILTIN_COLON:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void _rc_snapshot_write(const char *path, const SnapshotHeader *key, RcNames *names) {
+	SnapshotHeader header = *key;
+	size_t size = sizeof(header);
+
+	header.count = 0;
+	for (int i = 0; i < OPT_COUNT; i++) header.options[i] = options[i];
+	char *buf = malloc(size);
+
+	// sorted by name, then in the order they ran: the last set or unset of a name decides
+	qsort(names->names, names->count, sizeof(RcName), _rc_name_cmp);
+	for (size_t i = 0; i < names->count; ) {
+		const char *name = names->names[i].name;
+		const size_t name_len = strlen(name);
+		unsigned int flags = 0;
+		for (; i < names->count && !strcmp(names->names[i].name, name); i++) {
+			if (names->names[i].flags != 0) flags = names->names[i].flags;
+		}
+
+		const Symbol *sym = intern(name, name_len, 0);
+		if (sym != NULL && sym->exported) flags |= SNAP_EXPORTED;
+		if ((flags & SNAP_VALUE) && (sym == NULL || sym->value == NULL)) flags = (flags & ~SNAP_VALUE) | SNAP_UNSET;
+
+		const SnapshotVar var = { name_len, flags & SNAP_VALUE ? strlen(sym->value) : 0, flags };
+		const size_t entry = SNAP_ALIGN(sizeof(var) + var.name_len + 1 + var.value_len + 1);
+		buf = realloc(buf, size + entry);
+		memset(buf + size, 0, entry);
+		memcpy(buf + size, &var, sizeof(var));
+		memcpy(buf + size + sizeof(var), name, name_len);
+		if (flags & SNAP_VALUE) memcpy(buf + size + sizeof(var) + name_len + 1, sym->value, var.value_len);
+		size += entry;
+		header.count++;
+	}
+	header.size = size;
+	memcpy(buf, &header, sizeof(header));
+
+	// written next to it and renamed, a startup reading it concurrently sees the old one or the new one
+	char tmp[BUFSIZE];
+	snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+	const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd != -1) {
+		const int ok = write(fd, buf, size) == (ssize_t) size;
+		close(fd);
+		if (!ok || rename(tmp, path) == -1) unlink(tmp);
+	}
+	free(buf);
+}
+
+/*
+ * Applies the snapshot at path if it was made from an rc file matching key, returns 0 otherwise
+ */
+
+int _rc_snapshot_load(const char *path, const SnapshotHeader *key) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1) return 0;
+	if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+		close(fd);
+		return 0;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return 0;
+
+	const SnapshotHeader *header = (const SnapshotHeader *) map;
+	int ok = header->magic == SNAPSHOT_MAGIC && header->noptions == OPT_COUNT && header->size == st.st_size &&
+		header->rc_size == key->rc_size && header->rc_mtime[0] == key->rc_mtime[0] &&
+		header->rc_mtime[1] == key->rc_mtime[1] && header->rc_hash == key->rc_hash;
+
+	// checked whole before applying any of it
+	size_t off = sizeof(SnapshotHeader);
+	for (unsigned int i = 0; ok && i < header->count; i++) {
+		const SnapshotVar *var = (const SnapshotVar *) (map + off);
+		const char *name = map + off + sizeof(SnapshotVar);
+		ok = off + sizeof(SnapshotVar) <= header->size &&
+			off + SNAP_ALIGN(sizeof(SnapshotVar) + (size_t) var->name_len + var->value_len + 2) <= header->size &&
+			name[var->name_len] == '\0' && name[var->name_len + 1 + var->value_len] == '\0';
+		if (ok) off += SNAP_ALIGN(sizeof(SnapshotVar) + (size_t) var->name_len + var->value_len + 2);
+	}
+
+	off = sizeof(SnapshotHeader);
+	for (unsigned int i = 0; ok && i < header->count; i++) {
+		const SnapshotVar *var = (const SnapshotVar *) (map + off);
+		const char *name = map + off + sizeof(SnapshotVar);
+		if (var->flags & SNAP_UNSET) var_unset(name);
+		var_set(name, var->name_len, var->flags & SNAP_VALUE ? name + var->name_len + 1 : NULL, var->flags & SNAP_EXPORTED);
+		off += SNAP_ALIGN(sizeof(SnapshotVar) + (size_t) var->name_len + var->value_len + 2);
+	}
+	for (int i = 0; ok && i < OPT_COUNT; i++) {
+		if (options[i] != header->options[i]) set_option(i, header->options[i]);
+	}
+	munmap((void *) map, st.st_size);
+	return ok;
+}
+
+void load_rc(void) {
+	char path[BUFSIZE], snapshot[BUFSIZE];
+	const char *rc = var_get("MSHRC");
+	const char *base;
+
+	if (rc == NULL) {
+		if ((rc = var_get("HOME")) == NULL) return;
+		snprintf(path, sizeof(path), "%s/.mshrc", rc);
+		rc = path;
+	}
+	if (*rc == '\0') return;
+
+	const int fd = open(rc, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1) return;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return;
+	}
+
+	char *text = malloc(st.st_size + 2);
+	ssize_t len = 0, n;
+	while (len < st.st_size && (n = read(fd, text + len, st.st_size - len)) > 0) len += n;
+	close(fd);
+	if (len == 0 || text[len - 1] != '\n') text[len++] = '\n';
+	text[len] = '\0';
+
+	SnapshotHeader key = { SNAPSHOT_MAGIC, OPT_COUNT, 0, 0, st.st_size, { st.st_mtim.tv_sec, st.st_mtim.tv_nsec },
+		_hash64(14695981039346656037ull, text, len), { 0 } };
+
+	// lines starting with # are comments
+	for (char *line = text; *line != '\0'; line = strchr(line, '\n') + 1) {
+		char *word = line + strspn(line, " \t");
+		if (*word == '#') memset(word, ' ', strcspn(word, "\n"));
+	}
+	int have_snapshot = 1;
+	if ((base = var_get("XDG_CACHE_HOME")) != NULL) snprintf(snapshot, sizeof(snapshot), "%s/msh/rc.snapshot", base);
+	else if ((base = var_get("HOME")) != NULL) snprintf(snapshot, sizeof(snapshot), "%s/.cache/msh/rc.snapshot", base);
+	else have_snapshot = 0;
+
+	if (have_snapshot && _rc_snapshot_load(snapshot, &key)) {
+		free(text);
+		return;
+	}
+
+	int incomplete;
+	arena_reset(&line_arena);
+	const Node *root = parse_line(&line_arena, text, &incomplete);
+	if (incomplete) fprintf(stderr, "msh: %s: syntax error: unexpected end of file\n", rc);
+
+	RcNames names = { NULL, 0, 0 };
+	if (root != NULL && !incomplete) {
+		const int cacheable = _rc_cacheable(root, &names);
+		eval_node(root);
+		if (cacheable && have_snapshot) {
+			make_parents(snapshot);
+			_rc_snapshot_write(snapshot, &key, &names);
+		}
+	}
+	for (size_t i = 0; i < names.count; i++) free(names.names[i].name);
+	free(names.names);
+	free(text);
+}
+
+/*
+ * Concurrent scripts (msh -j N script...)
+ *
+ * Every script runs as a coroutine with its own stack and its own copy of the shell state: jobs,
+ * variables, cwd, stdout, the line arena and loop state. The state lives in the usual globals while the
+ * script runs and is swapped out into its Script when it yields, which happens whenever it would wait
+ * in event_loop_wait(). A single scheduler polls for all of them: one SIGCHLD pipe and reaper,
+ * one zygote, and a status is handed to the script that owns the pid.
+ * Scripts resume after every poll and go back to waiting if their job hasn't finished.
+ */
+
+#define SCRIPT_STACK (1024 * 1024) // plus a PROT_NONE guard page below it
+
+#define SWAP(a, b) do { __typeof__(a) tmp = a; a = b; b = tmp; } while (0)
+
+struct Script {
+	const char *file;
+	ucontext_t context;
+	void *stack;
+	int started;
+	int done;
+	int status;
+	int wait_fd; // fd passed to event_loop_wait(), -1 if none
+	int ready;
+	int cwd_fd;
+	FILE *input;
+	char *buf;
+
+	// shell state while the script is swapped out
+	Job *jobs;
+	int job_count;
+	int last_status;
+	int interrupted;
+	Symbol **symbols;
+	size_t symbol_cap;
+	size_t symbol_count;
+	char **envp_cache;
+	int envp_dirty;
+	Arena line_arena;
+	LoopControl loop_control;
+	int loop_depth;
+	Substitutions *current_substs;
+	Capture *current_capture;
+	FILE *stdout;
+};
+
+Script *scripts = NULL;
+int script_count = 0;
+ucontext_t scheduler_context;
+
+void _swap_state(Script *script) {
+	SWAP(jobs, script->jobs);
+	SWAP(job_count, script->job_count);
+	SWAP(last_status, script->last_status);
+	SWAP(interrupted, script->interrupted);
+	SWAP(symbols, script->symbols);
+	SWAP(symbol_cap, script->symbol_cap);
+	SWAP(symbol_count, script->symbol_count);
+	SWAP(envp_cache, script->envp_cache);
+	SWAP(envp_dirty, script->envp_dirty);
+	SWAP(line_arena, script->line_arena);
+	SWAP(loop_control, script->loop_control);
+	SWAP(loop_depth, script->loop_depth);
+	SWAP(current_substs, script->current_substs);
+	SWAP(current_capture, script->current_capture);
+	SWAP(stdout, script->stdout);
+}
+
+void _script_main(void) {
+	Script *script = current_script;
+	Input input = { NULL, 0 };
+	size_t cap = 0;
+
+	while (getline(&script->buf, &cap, script->input) != -1) {
+		feed_line(&input, script->buf);
+	}
+	if (input.len > 0) fprintf(stderr, "%s: syntax error: unexpected end of file\n", script->file);
+	free(input.text);
+	fflush(stdout);
+	script->status = last_status;
+	script->done = 1;
+	// returning resumes scheduler_context through uc_link
+}
+
+int script_yield(const int wait_fd) {
+	Script *script = current_script;
+
+	fflush(stdout);
+	script->wait_fd = wait_fd;
+	script->ready = 0;
+	swapcontext(&script->context, &scheduler_context);
+	return script->ready;
+}
+
+void script_exit(void) {
+	capture_unwind(); // exit in a $(...) ends the script, its output goes where the script's does
+	fflush(stdout);
+	current_script->status = last_status;
+	current_script->done = 1;
+	setcontext(&scheduler_context);
+}
+
+/*
+ * Hands the status of a pid that isn't in the current job table to the script that spawned it
+ */
+
+void script_child_status(const pid_t pid, const int status) {
+	if (current_script != NULL) return; // only the scheduler reaps
+
+	for (int i = 0; i < script_count; i++) {
+		if (!scripts[i].started) continue;
+		_swap_state(&scripts[i]);
+		Job *job = _get_job_by_pid(pid);
+		if (job != NULL) job_status(job, pid, status);
+		_swap_state(&scripts[i]);
+		if (job != NULL) return;
+	}
+}
+
+int _script_start(Script *script, const char *file) {
+	memset(script, 0, sizeof(Script));
+	script->file = file;
+	script->wait_fd = -1;
+	script->input = fopen(file, "r");
+	if (script->input == NULL) {
+		fprintf(stderr, "msh: %s: ", file);
+		perror("fopen");
+		script->status = 127;
+		script->done = 1;
+		return 0;
+	}
+	fcntl(fileno(script->input), F_SETFD, FD_CLOEXEC);
+
+	// a recursion too deep for the stack faults on the guard page instead of writing over the next mapping
+	const size_t guard = sysconf(_SC_PAGESIZE);
+	script->stack = mmap(NULL, guard + SCRIPT_STACK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+		-1, 0);
+	if (script->stack == MAP_FAILED || mprotect(script->stack, guard, PROT_NONE) == -1) {
+		fprintf(stderr, "msh: %s: ", file);
+		perror("mmap");
+		if (script->stack != MAP_FAILED) munmap(script->stack, guard + SCRIPT_STACK);
+		fclose(script->input);
+		script->status = 1;
+		script->done = 1;
+		return 0;
+	}
+	script->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	getcontext(&script->context);
+	script->context.uc_stack.ss_sp = (char *) script->stack + guard;
+	script->context.uc_stack.ss_size = SCRIPT_STACK;
+	script->context.uc_link = &scheduler_context;
+	makecontext(&script->context, _script_main, 0);
+
+	// a fresh state, with variables imported from the environment like a new shell
+	script->envp_dirty = 1;
+	script->loop_control = LOOP_NONE;
+	script->stdout = stdout;
+	_swap_state(script);
+	import_environ(environ);
+	update_pwd();
+	_swap_state(script);
+	script->started = 1;
+	return 1;
+}
+
+void _script_finish(Script *script) {
+	_swap_state(script);
+	free_symbols(symbols, symbol_cap);
+	if (envp_cache != NULL) {
+		for (int i = 0; envp_cache[i] != NULL; i++) free(envp_cache[i]);
+		free(envp_cache);
+	}
+	while (job_count > 0) _remove_job(job_count - 1); // background jobs it never waited for
+	arena_reset(&line_arena);
+	free(line_arena.head);
+	free(line_arena.spare);
+	_swap_state(script);
+
+	munmap(script->stack, sysconf(_SC_PAGESIZE) + SCRIPT_STACK);
+	close(script->cwd_fd);
+	fclose(script->input);
+	free(script->buf);
+	script->started = 0;
+}
+
+void _script_resume(Script *script, const int shell_cwd) {
+	_swap_state(script);
+	fchdir(script->cwd_fd);
+
+	current_script = script;
+	swapcontext(&scheduler_context, &script->context);
+	current_script = NULL;
+
+	close(script->cwd_fd);
+	script->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	fchdir(shell_cwd);
+	_swap_state(script);
+}
+
+/*
+ * Waits for a child, captured output or a script's wait_fd, then reaps for every script
+ */
+
+void _scripts_poll(void) {
+	int nfds = 2;
+	for (int i = 0; i < script_count; i++) {
+		nfds += scripts[i].started;
+		for (int j = 0; j < scripts[i].job_count; j++) nfds += job_poll_max(&scripts[i].jobs[j]);
+	}
+
+	struct pollfd fds[nfds];
+	int owners[nfds];
+	int job_ids[nfds];
+	nfds = 0;
+
+	fds[nfds].fd = sigchld_pipe[0];
+	fds[nfds++].events = POLLIN;
+	fds[nfds].fd = zygote_fd;
+	fds[nfds++].events = POLLIN;
+	for (int i = 0; i < script_count; i++) {
+		const Script *script = &scripts[i];
+		if (!script->started) continue;
+		for (int j = 0; j < script->job_count; j++) {
+			const int n = job_poll(&script->jobs[j], fds + nfds);
+			for (int k = 0; k < n; k++, nfds++) {
+				owners[nfds] = i;
+				job_ids[nfds] = script->jobs[j].id;
+			}
+		}
+		if (script->wait_fd != -1) {
+			owners[nfds] = i;
+			job_ids[nfds] = -1;
+			fds[nfds].fd = script->wait_fd;
+			fds[nfds++].events = POLLIN;
+		}
+	}
+
+	if (poll(fds, nfds, -1) == -1) {
+		if (errno != EINTR) perror("poll");
+		return;
+	}
+
+	for (int i = 2; i < nfds; i++) {
+		if (fds[i].revents == 0) continue;
+		Script *script = &scripts[owners[i]];
+		if (job_ids[i] == -1) {
+			script->ready = 1;
+			continue;
+		}
+		_swap_state(script);
+		job_event(job_ids[i], fds[i].fd);
+		_swap_state(script);
+	}
+	if (fds[0].revents) reap_children();
+	if (fds[1].revents) zygote_drain();
+}
+
+/*
+ * Runs the scripts, up to max_running at a time. Returns the first non zero status, 0 if all succeeded.
+ */
+
+int run_scripts(char **files, const int count, const int max_running) {
+	const int shell_cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	int next = 0, running = 0, status = 0;
+
+	scripts = calloc(count, sizeof(Script));
+	script_count = count;
+
+	while (next < count || running > 0) {
+		while (next < count && running < max_running) {
+			running += _script_start(&scripts[next], files[next]);
+			next++;
+		}
+		for (int i = 0; i < count; i++) {
+			if (!scripts[i].started) continue;
+			_script_resume(&scripts[i], shell_cwd);
+			if (scripts[i].done) {
+				_script_finish(&scripts[i]);
+				running--;
+			}
+		}
+		if (running > 0) _scripts_poll();
+	}
+
+	for (int i = 0; i < count && status == 0; i++) status = scripts[i].status;
+	free(scripts);
+	scripts = NULL;
+	script_count = 0;
+	close(shell_cwd);
+	return status;
+}
+
+int main (int argc, char **argv)
+{
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN); // the fan-out pump gets EPIPE from consumers that exited
+
+	// job control on a terminal: the shell gets its own process group and gives the terminal to each job
+	if (isatty(STDIN_FILENO) && argc == 1) {
+		while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) kill(-shell_pgid, SIGTTIN); // until foreground
+		signal(SIGTSTP, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
+		signal(SIGTTOU, SIG_IGN);
+		setpgid(0, 0);
+		shell_pgid = getpgrp();
+		tcsetpgrp(STDIN_FILENO, shell_pgid);
+		job_control = 1;
+	}
+
+	if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+		perror("pipe2");
+		exit(1);
+	}
+	signal(SIGCHLD, sigchld_handler);
+	const char *early = getenv("MSH_ZYGOTE");
+	if (early != NULL && *early != '\0') set_option(OPT_ZYGOTE, 1); // forked while the shell is still small
+
+	import_environ(environ);
+	update_pwd();
+
+	// msh [-j N] script...
+	int max_running = 1, first = 1;
+	if (argc > 2 && !strcmp(argv[1], "-j")) {
+		max_running = atoi(argv[2]) > 0 ? atoi(argv[2]) : 1;
+		first = 3;
+	}
+	if (first < argc) return run_scripts(argv + first, argc - first, max_running);
+	load_rc();
+
+	Input input = { NULL, 0 };
+
+	while (1) {
+		if (input.len == 0) print_prompt(1);
+		else fputs("> ", stdout);
+		fflush(stdout);
+
+		prompt_shown = input.len == 0;
+		const char *line = read_line();
+		prompt_shown = 0;
+		if (line == NULL) {
+			if (input.len > 0) fprintf(stderr, "msh: syntax error: unexpected end of file\n");
+			printf("\n");
+			break;
+		}
+		feed_line(&input, line);
+	}
+	free(input.text);
+
+	return last_status;
 }
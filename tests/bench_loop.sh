@@ -0,0 +1,44 @@
+#!/bin/sh
+#
+# Benchmark of loops run from the parsed tree against the same commands unrolled into a script
+#
+# Usage: tests/bench_loop.sh [path/to/msh] [iterations]
+#
+# The loop is two nested for loops (iterations / 100 by 100) whose body is "true; :", plus an
+# assignment of the loop variable in a second run. The unrolled script has the body once per iteration,
+# so every line is read, parsed and tokenized. Both are fed on stdin; the times are wall clock.
+
+MSH=$(realpath "${1:-./msh}")
+ITERATIONS=${2:-100000}
+OUTER=$((ITERATIONS / 100))
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# run NAME FILE: prints the wall clock time msh takes on FILE
+run() {
+	start=$(date +%s%N)
+	"$MSH" < "$2" > /dev/null
+	end=$(date +%s%N)
+	awk -v name="$1" -v ns=$((end - start)) -v n="$ITERATIONS" \
+		'BEGIN { printf "%-28s %8.3f s  %8.2f us/iteration\n", name, ns / 1e9, ns / 1e3 / n }'
+}
+
+# bench BODY: the loop and the unrolled script with BODY as the body, $i being the iteration
+bench() {
+	{
+		echo "for i in $(seq -s ' ' 0 $((OUTER - 1))); do"
+		echo "for j in $(seq -s ' ' 0 99); do"
+		echo "$1"
+		echo "done; done"
+	} > loop.msh
+	seq 0 $((ITERATIONS - 1)) | awk -v body="$1" '{ line = body; gsub(/\$i/, $1, line); print line }' > unrolled.msh
+
+	echo "body: $1"
+	run "loop ($OUTER x 100)" loop.msh
+	run "unrolled ($ITERATIONS lines)" unrolled.msh
+}
+
+bench 'true; :'
+bench 'N=$i; true'
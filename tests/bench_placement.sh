@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Benchmark of a CPU-bound pipeline with stage placement off and on (set -o placement)
+#
+# Usage: tests/bench_placement.sh [path/to/msh] [bytes] [runs]
+#
+# Each run pushes the bytes through head | gzip -1 | gzip -d | wc -c, started in the background so
+# jobs -l can show where the stages were pinned, and brought back with fg. Off and on runs alternate,
+# and the best throughput of each is printed. On a single CPU placement does nothing.
+
+MSH=$(realpath "${1:-./msh}")
+BYTES=${2:-1000000000}
+RUNS=${3:-3}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+# run on|off: prints the seconds the pipeline took
+run() {
+	flag=+o
+	[ "$1" = on ] && flag=-o
+	printf '%s\n' "set $flag placement" \
+		"head -c $BYTES /dev/zero | gzip -1 | gzip -d | wc -c > /dev/null &" "jobs -l" "fg" > bench.msh
+	start=$(date +%s%N)
+	"$MSH" < bench.msh > "jobs-$1.txt" 2>&1
+	end=$(date +%s%N)
+	echo $((end - start))
+}
+
+echo "$(nproc) CPUs, $BYTES bytes per run"
+best_off=0
+best_on=0
+for r in $(seq "$RUNS"); do
+	off=$(run off)
+	on=$(run on)
+	[ "$best_off" -eq 0 ] || [ "$off" -lt "$best_off" ] && best_off=$off
+	[ "$best_on" -eq 0 ] || [ "$on" -lt "$best_on" ] && best_on=$on
+done
+
+awk -v b="$BYTES" -v off="$best_off" -v on="$best_on" 'BEGIN {
+	printf "placement off  %8.3f s  %8.1f MB/s\n", off / 1e9, b / (off / 1e9) / 1e6
+	printf "placement on   %8.3f s  %8.1f MB/s  (%+.1f%%)\n", on / 1e9, b / (on / 1e9) / 1e6, (off / on - 1) * 100
+}'
+echo "stages with placement on:"
+grep -E '^[[:space:]]+[0-9]+' jobs-on.txt
@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Benchmark of spawning commands with fork against spawning them through the zygote (set -o zygote)
+#
+# Usage: tests/bench_spawn.sh [path/to/msh] [commands] [ballast MB]
+#
+# The script runs /bin/true once per line, with set +o zygote, with set -o zygote, and with the zygote
+# forked at startup (MSH_ZYGOTE=1). Before that it stores a variable of the ballast size, so the shell
+# being forked is as big as a long-lived one; the zygote forked at startup doesn't carry it.
+# The script is fed on stdin; the times are wall clock and include the ballast.
+
+MSH=$(realpath "${1:-./msh}")
+COMMANDS=${2:-5000}
+BALLAST=${3:-0}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+if [ "$BALLAST" -gt 0 ]; then
+	head -c $((BALLAST * 1000000)) /dev/zero | tr '\0' x > ballast
+	echo 'B=$(cat ballast)' > head.msh
+else
+	: > head.msh
+fi
+
+# run NAME SET [ENV]: prints the wall clock time msh takes on the script, with set SET zygote first
+run() {
+	{ cat head.msh; echo "set $2 zygote"; yes /bin/true | head -n "$COMMANDS"; } > bench.msh
+	start=$(date +%s%N)
+	env $3 "$MSH" < bench.msh > /dev/null
+	end=$(date +%s%N)
+	awk -v name="$1" -v ns=$((end - start)) -v n="$COMMANDS" \
+		'BEGIN { printf "%-22s %8.3f s  %8.2f us/command\n", name, ns / 1e9, ns / 1e3 / n }'
+}
+
+echo "$COMMANDS x /bin/true, ${BALLAST} MB ballast"
+run "fork" +o
+run "zygote" -o
+run "zygote at startup" -o MSH_ZYGOTE=1
@@ -0,0 +1,86 @@
+/*
+ * Tokenizer throughput in GB/s
+ *
+ * A generated pipeline with a multi-kilobyte argument list, like the ones of batch scripts, is tokenized
+ * repeatedly by libparser.a's tokenize() and by tokenize_line() with each classifier the CPU can run.
+ * The classifiers are also timed alone on a single 64 byte block.
+ *
+ * Usage: bench_tokenize [line bytes] [repetitions]
+ */
+
+#define main msh_main
+#include "../main.c"
+#undef main
+
+double seconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+	const size_t size = argc > 1 ? (size_t) atol(argv[1]) : 1 << 16;
+	const int reps = argc > 2 ? atoi(argv[2]) : 2000;
+	const char *names[] = { "scalar", "sse2", "avx2" };
+	void (*classifiers[])(const char *, unsigned long long *, unsigned long long *) = {
+		_classify_scalar,
+#ifdef __x86_64__
+		_classify_sse2,
+		__builtin_cpu_supports("avx2") ? _classify_avx2 : NULL,
+#endif
+	};
+	const int nclassifiers = sizeof(classifiers) / sizeof(classifiers[0]);
+
+	import_environ(environ); // for the PATH lookups
+	if (size < 128) {
+		fprintf(stderr, "bench_tokenize: the line needs at least 128 bytes\n");
+		return 1;
+	}
+
+	// arguments of 4 to 23 bytes, then a pipe, a redirection and &
+	char *line = malloc(size + 1);
+	size_t len = sprintf(line, "/bin/echo");
+	srand(1);
+	while (len < size - 64) {
+		len += sprintf(line + len, " %.*s", 4 + rand() % 20, "/some/longer/path/argument_value_xyz_0123456789");
+	}
+	len += sprintf(line + len, " | /bin/cat > /dev/null &\n");
+	printf("line of %zu bytes, %d repetitions\n", len, reps);
+
+	// tokenize() writes into the line and never frees its tline, so it gets a copy each time
+	char *copy = malloc(len + 1);
+	double total = 0;
+	for (int i = 0; i < reps; i++) {
+		memcpy(copy, line, len + 1);
+		const double start = seconds();
+		tokenize(copy);
+		total += seconds() - start;
+	}
+	printf("tokenize()             %7.3f GB/s\n", len * (double) reps / total / 1e9);
+
+	Arena arena = { NULL };
+	for (int c = 0; c < nclassifiers; c++) {
+		if (classifiers[c] == NULL) continue;
+		classify_block = classifiers[c];
+
+		double start = seconds();
+		for (int i = 0; i < reps; i++) {
+			tokenize_line(&arena, line, len);
+			arena_reset(&arena);
+		}
+		printf("tokenize_line() %-6s %7.3f GB/s\n", names[c], len * (double) reps / (seconds() - start) / 1e9);
+
+		const long blocks = 20000000;
+		char block[64];
+		unsigned long long space, symbol;
+		memcpy(block, line, sizeof(block));
+		start = seconds();
+		for (long i = 0; i < blocks; i++) {
+			block[0] = (char) i; // the compiler can't hoist the call
+			classify_block(block, &space, &symbol);
+			__asm__ volatile("" : : "r"(space), "r"(symbol));
+		}
+		printf("  classifier alone     %7.3f GB/s\n", sizeof(block) * (double) blocks / (seconds() - start) / 1e9);
+	}
+	return 0;
+}
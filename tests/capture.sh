@@ -0,0 +1,79 @@
+#!/bin/sh
+#
+# set -o capture: background jobs write into a ring buffer that output prints, set -o spill keeps what
+# doesn't fit in it in a file. The "finished" notices come whenever the job is reaped, so they aren't compared.
+
+. "$(dirname "$0")/lib.sh"
+
+NOTICES='^Job \[[0-9]+\] .* finished with status|^$'
+
+# summary NAME EXPECTED < SCRIPT: like check, comparing only the first two and the last two lines, and
+# the number of lines
+summary() {
+	cat > "$1.msh"
+	actual=$("$MSH" "$1.msh" 2>&1 | grep -Ev "$NOTICES" |
+		awk 'NR <= 2 { print } { before = last; last = $0 } END { print before; print last; print NR " lines" }')
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+executable slow.sh <<'EOF2'
+echo early
+sleep 0.5
+echo late >&2
+EOF2
+
+check small "1
+2
+3
+Deleted job [0]
+There are no jobs." "$NOTICES" <<'EOF2'
+set -o capture
+seq 1 3 &
+sleep 0.3
+output 0
+jobs
+EOF2
+
+# stderr is captured too, output prints everything so far and deletes the job once it finished
+check running "early
+[0] Running 		./slow.sh &
+early
+late
+Deleted job [0]" "$NOTICES" <<'EOF2'
+set -o capture
+./slow.sh &
+sleep 0.2
+output 0
+jobs
+sleep 0.6
+output 0
+EOF2
+
+# the ring keeps the last 64 KiB and says how much it dropped
+summary dropped "[... $(($(seq 1 200000 | wc -c) - 65536)) bytes dropped ...]
+$(seq 1 200000 | tail -c 65536 | head -n 1)
+200000
+Deleted job [0]
+$(($(seq 1 200000 | tail -c 65536 | wc -l) + 2)) lines" <<'EOF2'
+set -o capture
+seq 1 200000 &
+sleep 0.5
+output 0
+EOF2
+
+summary spilled "1
+2
+200000
+Deleted job [0]
+200001 lines" <<'EOF2'
+set -o capture
+set -o spill
+seq 1 200000 &
+sleep 0.5
+output 0
+EOF2
+
+finish
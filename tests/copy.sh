@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# The cat copy fast path: done in the shell with copy_file_range() or sendfile(), which time reports on
+# a copy line, and left to cat for everything it can't do the same way
+
+. "$(dirname "$0")/lib.sh"
+
+# timed NAME EXPECTED < SCRIPT: like check, without time's real/user/sys lines and the copy speed
+timed() {
+	cat > "$1.msh"
+	actual=$("$MSH" "$1.msh" 2>&1 | grep -Ev '^(real|user|sys)	|^$' | sed -E 's/, [0-9.]+ MB\/s//')
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+printf 'hello\n' > a
+printf 'world\n' > b
+
+timed plain "copy	6 bytes (copy_file_range)
+hello" <<'EOF2'
+time cat a > c
+cat c
+EOF2
+
+timed files "copy	18 bytes (copy_file_range)
+hello
+world
+hello" <<'EOF2'
+time cat a b a > c
+cat c
+EOF2
+
+timed stdin "copy	6 bytes (copy_file_range)
+hello" <<'EOF2'
+time cat < a > c
+cat c
+EOF2
+
+# /proc files say they're empty, copy_file_range() would copy nothing
+timed proc "copy	$(wc -c < /proc/version) bytes (sendfile)
+same" <<'EOF2'
+time cat /proc/version > v
+cmp v /proc/version && echo same
+EOF2
+
+# cat runs: no copy line
+timed fallback "cat: c: input file is output file
+hello
+hello
+hello
+hello" <<'EOF2'
+cat a > c
+time cat a c > c
+time cat - < a > d
+cat d
+time cat a > e 2> err
+cat e
+JOB_TIMEOUT=10
+time cat a > f
+unset JOB_TIMEOUT
+set -o perf
+time cat a > g
+set +o perf
+cat f g
+EOF2
+
+finish
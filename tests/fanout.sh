@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# Fan-out (producer |& { consumer, ... }): every consumer gets the whole stream, and one that exits
+# early doesn't hold up the others. The lines run under timeout so a stall fails instead of hanging.
+
+. "$(dirname "$0")/lib.sh"
+
+seq 1 100000 > numbers
+
+check full "0 0 0 0 0 0
+100000
+100000
+1
+same" <<'EOF2'
+timeout 10 seq 1 100000 |& { wc -l > count, tail -n 1 > last, head -n 1 > first, cat > copy }
+echo $? $PIPESTATUS
+cat count last first
+cmp copy numbers && echo same
+EOF2
+
+# a consumer that fails sets the status like the last stage of a pipeline
+check early "0 0 0 0 0
+1
+300000
+1 0 0 0 1
+3000000" <<'EOF2'
+timeout 10 seq 1 300000 |& { head -n 1 > first, wc -l > count, true }
+echo $? $PIPESTATUS
+cat first count
+timeout 10 head -c 3000000 /dev/zero |& { true, wc -c > bytes, false }
+echo $? $PIPESTATUS
+cat bytes
+EOF2
+
+# a consumer can be a pipeline of its own
+check filters "$(grep -c 5 numbers)
+$(grep -v 0 numbers | wc -l)
+2" <<'EOF2'
+timeout 10 seq 1 100000 |& { grep -c 5 > fives, grep -v 0 | wc -l > nozero, sed -n 2p > second }
+cat fives nozero second
+EOF2
+
+finish
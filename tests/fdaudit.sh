@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# set -o fdaudit: nothing to report after any kind of line the shell runs, and a report for an fd the
+# shell was started with that its children would inherit
+
+. "$(dirname "$0")/lib.sh"
+
+# whatever runs the test may leave fds open to it (ctest does), msh would rightly report them
+exec 3<&- 4<&- 5<&- 6<&- 7<&- 8<&- 9<&-
+
+NOTICES='^Job \[[0-9]+\] .* finished with status|^$|^(real|user|sys)	'
+
+check clean "1
+2
+Deleted job [0]
+1
+Deleted job [0]
+100
+100
+sub
+3
+3
+end" "$NOTICES" <<'EOF2'
+set -o fdaudit
+set -o capture
+seq 1 2 &
+sleep 0.2
+output 0
+set +o capture
+ls / | grep -c -x bin | cat > n
+cat n
+wc -l < n 2> err >> n2
+true &
+sleep 0.1
+timeout 5 true | cat
+seq 1 100 |& { wc -l > lines, tail -n 1 > last }
+cat lines last
+X=$(/bin/echo sub | cat)
+echo $X
+echo */ > /dev/null
+memo seq 1 3 | wc -l
+memo seq 1 3 | wc -l
+time true
+echo end
+EOF2
+
+exec 5< /dev/null
+check inherited "fdaudit: fd 5 (/dev/null) inherited by children after: ls / > /dev/null" <<'EOF2'
+set -o fdaudit
+ls / > /dev/null
+EOF2
+exec 5<&-
+
+finish
@@ -0,0 +1,158 @@
+/*
+ * Differential fuzz test of the in-tree tokenizer against libparser.a's tokenize()
+ *
+ * Random lines built from words, symbols, blanks and non-ASCII bytes are tokenized by both, and
+ * tokenize_line() has to give the same tline with each of the classifiers the CPU can run.
+ * tokenize() runs in a child per line, since some inputs crash it.
+ *
+ * Lines are left out when the two tokenizers are meant to differ:
+ *   - extended redirections (N< N> >> &> >&N <&N >&-), which tokenize() doesn't know;
+ *   - >& followed by a symbol or by nothing, where tokenize() takes the symbol or garbage as the file.
+ *
+ * Usage: fuzz_tokenize [iterations] [seed]
+ */
+
+#define main msh_main
+#include "../main.c"
+#undef main
+
+#include <ctype.h>
+
+const char *pieces[] = {
+	"ls", "wc", "-l", "x", "/bin/sh", "./nope", "a$b", "\"q", "'r", "|", "<", ">", "&", ">&", " ", "  ", "\t",
+	"\v", "\r", "\xc3\xa9", ";", "$(0)", "2",
+};
+
+#define NPIECES (int) (sizeof(pieces) / sizeof(pieces[0]))
+
+int extended(const char *line) {
+	for (const char *p = line; *p != '\0'; p++) {
+		if ((p[0] == '&' && p[1] == '>') || (p[0] == '>' && p[1] == '>') || (p[0] == '<' && p[1] == '&')) return 1;
+		if (p[0] == '>' && p[1] == '&' && (isdigit((unsigned char) p[2]) || p[2] == '-')) return 1;
+		if (isdigit((unsigned char) p[0]) && (p[1] == '<' || p[1] == '>') &&
+			(p == line || char_class[(unsigned char) p[-1]] != 0)) return 1;
+	}
+	return 0;
+}
+
+/*
+ * > & (the error redirection, blanks or not between them) with a symbol or the end of the line after it
+ */
+
+const char *skip_blanks(const char *p) {
+	while (*p != '\0' && char_class[(unsigned char) *p] == CHAR_SPACE) p++;
+	return p;
+}
+
+int dangling_error(const char *line) {
+	for (const char *p = strchr(line, '>'); p != NULL; p = strchr(p + 1, '>')) {
+		const char *q = skip_blanks(p + 1);
+		if (*q != '&') continue;
+		q = skip_blanks(q + 1);
+		if (*q == '\0' || char_class[(unsigned char) *q] == CHAR_SYMBOL) return 1;
+	}
+	return 0;
+}
+
+void dump(char *out, const size_t cap, const tline *line) {
+	if (line == NULL) {
+		snprintf(out, cap, "NULL");
+		return;
+	}
+	size_t len = snprintf(out, cap, "n=%d bg=%d in=%s out=%s err=%s", line->ncommands, line->background,
+		line->redirect_input ? line->redirect_input : "-", line->redirect_output ? line->redirect_output : "-",
+		line->redirect_error ? line->redirect_error : "-");
+	for (int i = 0; i < line->ncommands && len < cap; i++) {
+		const tcommand *cmd = &line->commands[i];
+		len += snprintf(out + len, cap - len, " |%s|", cmd->filename ? cmd->filename : "(null)");
+		for (int j = 0; j < cmd->argc && len < cap; j++) len += snprintf(out + len, cap - len, " [%s]", cmd->argv[j]);
+	}
+}
+
+/*
+ * tokenize()'s tline for line, dumped by a child. Returns 0 if it crashed.
+ */
+
+int lib_tokenize(const char *line, char *out, const size_t cap) {
+	int fds[2];
+	if (pipe(fds) == -1) {
+		perror("pipe");
+		exit(2);
+	}
+
+	const pid_t pid = fork();
+	if (pid == 0) {
+		char buf[strlen(line) + 2];
+		snprintf(buf, sizeof(buf), "%s\n", line);
+		dump(out, cap, tokenize(buf));
+		if (write(fds[1], out, strlen(out)) == -1) _exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+
+	size_t len = 0;
+	ssize_t n;
+	while (len < cap - 1 && (n = read(fds[0], out + len, cap - 1 - len)) > 0) len += n;
+	out[len] = '\0';
+	close(fds[0]);
+
+	int status;
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+int main(int argc, char **argv) {
+	const long iterations = argc > 1 ? atol(argv[1]) : 20000;
+	const unsigned seed = argc > 2 ? (unsigned) atol(argv[2]) : 42;
+	const char *names[] = { "scalar", "sse2", "avx2" };
+	void (*classifiers[])(const char *, unsigned long long *, unsigned long long *) = {
+		_classify_scalar,
+#ifdef __x86_64__
+		_classify_sse2,
+		__builtin_cpu_supports("avx2") ? _classify_avx2 : NULL,
+#endif
+	};
+	const int nclassifiers = sizeof(classifiers) / sizeof(classifiers[0]);
+	static char line[16384], want[1 << 16], have[1 << 16];
+	long compared = 0, skipped = 0, crashes = 0, diffs = 0;
+
+	import_environ(environ); // for the PATH lookups
+	srand(seed);
+	if (freopen("/dev/null", "w", stderr) == NULL) return 2; // both report syntax errors
+
+	for (long it = 0; it < iterations; it++) {
+		// mostly short lines, and every tenth one long enough to span several 64 byte blocks
+		const int count = rand() % (it % 10 == 0 ? 400 : 12);
+		size_t len = 0;
+		line[0] = '\0';
+		for (int i = 0; i < count; i++) len += sprintf(line + len, "%s", pieces[rand() % NPIECES]);
+
+		if (extended(line) || dangling_error(line)) {
+			skipped++;
+			continue;
+		}
+		if (!lib_tokenize(line, want, sizeof(want))) {
+			crashes++;
+			continue;
+		}
+		compared++;
+
+		for (int c = 0; c < nclassifiers; c++) {
+			if (classifiers[c] == NULL) continue;
+			classify_block = classifiers[c];
+
+			Arena arena = { NULL };
+			dump(have, sizeof(have), tokenize_line(&arena, line, len));
+			if (strcmp(have, want) != 0 && diffs++ < 10) {
+				printf("%s: [%s]\n  tokenize()      %s\n  tokenize_line() %s\n", names[c], line, want, have);
+			}
+			arena_reset(&arena);
+			free(arena.head);
+			free(arena.spare);
+		}
+	}
+
+	printf("%ld lines compared, %ld skipped, %ld crashed tokenize(), %ld differences (seed %u)\n", compared, skipped,
+		crashes, diffs, seed);
+	return diffs != 0;
+}
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Glob expansion: * ? [...] and **, sorted, hidden names only matched by a pattern starting with a dot,
+# a pattern with no match kept as it is, and ** not descending into hidden or symlinked directories
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir -p sub/deep sub/.h .hid big
+touch a.txt b.txt c.md ab.txt .dot.txt sub/x.txt sub/deep/z.txt sub/.h/y.txt .hid/w.txt
+ln -s sub link
+# the names are read in getdents64 batches of 64 KiB, so this takes several
+seq -f 'big/f%05g' 1 5000 | xargs touch
+
+check star "a.txt ab.txt b.txt
+a.txt ab.txt b.txt c.md
+sub/deep sub/x.txt
+.dot.txt" <<'EOF2'
+echo *.txt
+echo *.t?t *.md
+echo sub/*
+echo .*.txt
+EOF2
+
+check classes "a.txt b.txt
+a.txt b.txt
+b.txt
+a.txt ab.txt b.txt big
+[z.txt" <<'EOF2'
+echo ?.txt
+echo [ab].txt
+echo [!a].txt
+echo [a-b]*
+echo [z.txt
+EOF2
+
+check nomatch "*.none
+x*y sub/*.none
+2" <<'EOF2'
+echo *.none
+echo x*y sub/*.none
+ls *.none 2> /dev/null
+echo $?
+EOF2
+
+# link/x.txt only through the literal path, .h and .hid never
+check recursive "sub/deep/z.txt sub/x.txt
+a.txt ab.txt b.txt sub/deep/z.txt sub/x.txt
+sub/deep/z.txt
+link/x.txt" <<'EOF2'
+echo sub/**/*.txt
+echo **/*.txt
+echo **/z.txt
+echo link/*.txt
+EOF2
+
+check large "5000
+big/f00001
+big/f05000
+big/f04999 big/f05000" <<'EOF2'
+echo big/* | wc -w
+ls big/* | head -n 1
+ls big/* | tail -n 1
+echo big/f0499[9] big/f0500?
+EOF2
+
+finish
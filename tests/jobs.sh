@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# Job states as jobs shows them (Running, Stopped, Done, Timed out), bg, fg and kill %n, and jobs -l.
+# There's no terminal, so stopping takes kill -STOP instead of Ctrl-Z.
+
+. "$(dirname "$0")/lib.sh"
+
+check states "[0] Running 		sleep 5 &
+
+Job [0] (sleep 5 &) stopped
+[0] Stopped 		sleep 5 &
+[0] sleep 5 &
+[0] Running 		sleep 5 &
+0
+
+Job [0] terminated with signal 15
+Deleted job [0]
+There are no jobs." <<'EOF2'
+sleep 5 &
+jobs
+kill -STOP %0
+sleep 0.2
+jobs
+bg %0
+jobs
+kill %0 > /dev/null
+echo $?
+sleep 0.2
+jobs
+EOF2
+
+# a captured job stays listed until its output is read
+executable slow.sh <<'EOF2'
+echo early
+sleep 2
+EOF2
+
+check finished "[0] Done 		seq 1 3 &
+[1] Timed out 		timeout 0.2 ./slow.sh &" '^Job \[[0-9]+\] .* (finished with status|timed out)|^$' <<'EOF2'
+set -o capture
+seq 1 3 &
+timeout 0.2 ./slow.sh &
+sleep 0.5
+jobs
+EOF2
+
+# the whole line is the job's command, timeout's too; -l adds a pid per stage
+check_sed long "[0] Running 		timeout 5 sleep 5 | cat &
+	PID
+	PID
+sleep 0.3 | cat &
+0" 's/^	[0-9]+$/	PID/; /^Job \[|^$|^Deleted job/d' <<'EOF2'
+timeout 5 sleep 5 | cat &
+jobs -l
+kill %0
+sleep 0.2
+sleep 0.3 | cat &
+fg %0
+echo $?
+EOF2
+
+check errors "kill: %7: no such job
+bg: Invalid job ID 3
+1" <<'EOF2'
+kill %7 > /dev/null
+bg %3
+echo $?
+EOF2
+
+finish
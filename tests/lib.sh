@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# Shared by the scripted tests, which ctest runs as: sh tests/<name>.sh path/to/msh
+#
+# A test runs in a fresh directory that is also its $HOME and cache directory, so it reads and writes
+# nothing outside it. check runs a script with msh and compares what it prints, stdout and stderr
+# together, with what it should. finish fails the test if any check did.
+
+MSH=$(realpath "$1")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+HOME=$WORK
+XDG_CACHE_HOME=$WORK/cache
+export HOME XDG_CACHE_HOME
+unset MSHRC JOB_TIMEOUT MEMO_SIZE
+failures=0
+
+# check NAME EXPECTED [IGNORE] < SCRIPT: runs SCRIPT as the file NAME.msh, so there are no prompts.
+# Lines of its output matching the regular expression IGNORE (timings, say) aren't compared.
+check() {
+	cat > "$1.msh"
+	if [ -n "$3" ]; then
+		actual=$("$MSH" "$1.msh" 2>&1 | grep -Ev "$3")
+	else
+		actual=$("$MSH" "$1.msh" 2>&1)
+	fi
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+# check_sed NAME EXPECTED SED < SCRIPT: like check, with the output edited by the sed script SED first,
+# for the parts that change from run to run (pids, say)
+check_sed() {
+	cat > "$1.msh"
+	actual=$("$MSH" "$1.msh" 2>&1 | sed -E "$3")
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+# executable NAME < SCRIPT: writes an sh script for the checks to run
+executable() {
+	{ echo '#!/bin/sh'; cat; } > "$1"
+	chmod +x "$1"
+}
+
+finish() {
+	if [ "$failures" -gt 0 ]; then
+		echo "$failures check(s) failed"
+		exit 1
+	fi
+	echo "all checks passed"
+	exit 0
+}
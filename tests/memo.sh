@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# memo: misses run the pipeline, hits replay its stdout and status without running it
+
+. "$(dirname "$0")/lib.sh"
+
+# prints how many times it ran, then fails with status 3
+executable count.sh <<'EOF2'
+echo ran >> runs.txt
+wc -l < runs.txt
+exit 3
+EOF2
+echo one > in.txt
+
+check hit_and_miss "1
+3
+1
+3
+memo: 1 hits, 1 misses, 0 evicted" <<'EOF2'
+memo ./count.sh
+echo $?
+memo ./count.sh
+echo $?
+memo -s
+EOF2
+
+# -i files are part of the key, by inode, size and mtime
+check input_change "one
+one
+changed
+memo: 1 hits, 2 misses, 0 evicted" <<'EOF2'
+memo -i in.txt cat in.txt
+memo -i in.txt cat in.txt
+echo changed > in.txt
+memo -i in.txt cat in.txt
+memo -s
+EOF2
+
+# the three entries above are evicted, count.sh runs again
+check clear "1
+2
+memo: 1 hits, 1 misses, 3 evicted" <<'EOF2'
+memo ./count.sh
+memo -c
+memo ./count.sh
+memo -s
+EOF2
+
+finish
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Per-stage perf counters: time -v prints a line per stage after real, user and sys, set -o perf gives
+# them to every job for jobs -l. Which counters there are depends on the machine (a PMU for cycles and
+# instructions, perf_event_paranoid for any), so only the shape of the lines is compared.
+
+. "$(dirname "$0")/lib.sh"
+
+# a stage line as its shape: no counters, or task-clock and then any number of "N name" counters
+SHAPE='s/^(	?stage [0-9]+)	(no counters|task-clock [0-9.]+s \([0-9]+% of [0-9.]+s alive\)(, [0-9]+ [a-z -]+( \([0-9.]+ per cycle\))?)*)$/\1 ok/'
+TIMES='s/^(real|user|sys)	[0-9]+m[0-9.]+s$/\1/; s/^	[0-9]+$/	PID/'
+
+check_sed verbose "100000
+
+real
+user
+sys
+stage 1 ok
+stage 2 ok
+0" "$SHAPE; $TIMES" <<'EOF2'
+time -v seq 1 100000 | wc -l
+echo $?
+EOF2
+
+# plain time has no stage lines
+check_sed plain "
+real
+user
+sys" "$TIMES" <<'EOF2'
+time true
+EOF2
+
+check_sed jobs "[0] Running 		sleep 0.2 | cat &
+	PID
+	PID
+	stage 1 ok
+	stage 2 ok
+[0] Running 		sleep 0.2 | cat &" "$SHAPE; $TIMES" <<'EOF2'
+set -o perf
+sleep 0.2 | cat &
+jobs -l
+set +o perf
+jobs
+EOF2
+
+finish
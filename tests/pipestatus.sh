@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# $PIPESTATUS, set -o pipefail and set -o failfast
+
+. "$(dirname "$0")/lib.sh"
+
+executable status.sh <<'EOF2'
+exit "$1"
+EOF2
+
+# $? is the last stage's status, PIPESTATUS has every stage's
+check pipestatus "0 1 0
+3 0 2 3
+1 1" <<'EOF2'
+false | true
+echo $? $PIPESTATUS
+./status.sh 0 | ./status.sh 2 | ./status.sh 3
+echo $? $PIPESTATUS
+false
+echo $? $PIPESTATUS
+EOF2
+
+# with pipefail it's the rightmost failed stage's
+check pipefail "1 1 0
+2 0 2 0
+0 0 0" <<'EOF2'
+set -o pipefail
+false | true
+echo $? $PIPESTATUS
+true | ./status.sh 2 | true
+echo $? $PIPESTATUS
+true | true
+echo $? $PIPESTATUS
+EOF2
+
+# a stage killed by SIGPIPE doesn't make the pipeline fail
+check sigpipe "0" <<'EOF2'
+set -o pipefail
+yes | head -n 1 > /dev/null
+echo $?
+EOF2
+
+# failfast terminates the other stages once one fails, instead of waiting for sleep
+start=$(date +%s)
+check failfast "1 143 1" <<'EOF2'
+set -o failfast
+sleep 10 | false
+echo $? $PIPESTATUS
+EOF2
+if [ $(($(date +%s) - start)) -ge 10 ]; then
+	echo "FAIL: failfast waited for sleep"
+	failures=$((failures + 1))
+fi
+
+finish
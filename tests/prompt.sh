@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# $PS1: msh> while it's unset, %d %? %j %_ %% and unknown segments, and %b, whose branch is found by a
+# worker thread: the prompt printed right after a cd or a PS1 change has none until the lookup is done.
+# Prompts only show when msh reads stdin; without a terminal they're never painted again.
+
+. "$(dirname "$0")/lib.sh"
+
+# prompts NAME EXPECTED < INPUT: feeds INPUT to msh on stdin and compares everything it prints
+prompts() {
+	actual=$("$MSH" 2>&1)
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+mkdir -p sub/deeper
+prompts segments "msh> ~ [0] 0% ~ [1] 0% ~/sub/deeper [0] 0% ~/sub/deeper [0] 1% / [0] 1% %x:msh> " <<'EOF2'
+PS1=%d%_[%?]%_%j%%%_
+false
+cd sub/deeper
+sleep 5 &
+cd /
+PS1=%x:
+unset PS1
+EOF2
+
+if command -v git > /dev/null; then
+	git init -q repo && git -C repo checkout -q -b topic
+	prompts branch "msh> msh> :topic::::topic:" <<'EOF2'
+cd repo
+PS1=%b:
+sleep 0.3
+cd /
+sleep 0.3
+cd ~/repo
+sleep 0.3
+EOF2
+fi
+
+finish
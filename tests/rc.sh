@@ -0,0 +1,85 @@
+#!/bin/sh
+#
+# The rc snapshot: written for an rc that only sets variables and options, used instead of the rc while
+# the rc's mtime, size and contents are unchanged, and thrown away when any of them changes
+
+. "$(dirname "$0")/lib.sh"
+
+SNAPSHOT=$XDG_CACHE_HOME/msh/rc.snapshot
+
+# interactive NAME EXPECTED < INPUT: feeds INPUT to msh on stdin, so it runs the rc, without the prompts
+interactive() {
+	actual=$("$MSH" 2>&1 | sed 's/msh> //g')
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+expect_snapshot() {
+	if [ "$2" = yes ] && [ ! -f "$SNAPSHOT" ]; then
+		printf 'FAIL: %s: no snapshot was written\n' "$1"
+		failures=$((failures + 1))
+	elif [ "$2" = no ] && [ -e "$SNAPSHOT" ]; then
+		printf 'FAIL: %s: a snapshot was written\n' "$1"
+		failures=$((failures + 1))
+	fi
+}
+
+printf 'GREETING=one\nset -o pipefail\n' > .mshrc
+interactive first "one
+1" <<'EOF2'
+echo $GREETING
+false | true
+echo $?
+EOF2
+expect_snapshot first yes
+
+# the value is changed in the snapshot only, so seeing it proves the rc wasn't run
+sed -i 's/one/ONE/' "$SNAPSHOT"
+interactive cached "ONE
+1" <<'EOF2'
+echo $GREETING
+false | true
+echo $?
+EOF2
+
+touch -d '1 minute ago' .mshrc
+interactive mtime "one" <<'EOF2'
+echo $GREETING
+EOF2
+
+# same size and mtime, different contents: only the hash tells them apart
+touch -r .mshrc ref
+printf 'GREETING=two\nset -o pipefail\n' > .mshrc
+touch -r ref .mshrc
+interactive contents "two" <<'EOF2'
+echo $GREETING
+EOF2
+
+printf 'GREETING=three\n' > .mshrc
+interactive size "three" <<'EOF2'
+echo $GREETING
+EOF2
+
+# a value taken from the environment can't be saved
+rm -f "$SNAPSHOT"
+printf 'WHERE=$HOME\n' > .mshrc
+interactive environment "$HOME" <<'EOF2'
+echo $WHERE
+EOF2
+expect_snapshot environment no
+
+# nor can a command's effects
+printf 'GREETING=four\necho hello\n' > .mshrc
+interactive command "hello
+four" <<'EOF2'
+echo $GREETING
+EOF2
+expect_snapshot command no
+
+MSHRC= interactive empty "" <<'EOF2'
+echo $GREETING
+EOF2
+
+finish
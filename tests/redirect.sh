@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Redirections: > and >> files, 2>&1 and its order against >, &> and N>&-
+
+. "$(dirname "$0")/lib.sh"
+
+executable both.sh <<'EOF2'
+echo out
+echo err >&2
+EOF2
+
+check append "one
+two
+three" <<'EOF2'
+echo one > f
+echo two >> f
+./both.sh >> f 2> /dev/null
+cat f | sed s/out/three/
+EOF2
+
+# 2>&1 copies what stdout is at that point, so the order of the redirections matters
+check dup "out
+err
+err
+out
+out
+err
+2" <<'EOF2'
+./both.sh > f 2>&1
+cat f
+./both.sh 2>&1 > g
+cat g
+./both.sh &> h
+cat h
+./both.sh 2>&1 | wc -l
+EOF2
+
+check append_both "out
+err
+out
+err" <<'EOF2'
+./both.sh &>> log
+./both.sh &>> log
+cat log
+EOF2
+
+# with stderr closed the error line goes nowhere
+check close "out" <<'EOF2'
+./both.sh 2>&-
+EOF2
+
+finish
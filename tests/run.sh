@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# run: tasks start after their dependencies, up-to-date tasks are skipped and failures stop dependents
+
+. "$(dirname "$0")/lib.sh"
+
+# a diamond, every task appends its name to order.txt
+cat > tasks <<'EOF2'
+all: left right
+	echo all >> order.txt
+left: base
+	echo left >> order.txt
+right: base
+	echo right >> order.txt
+base:
+	echo base >> order.txt
+made:
+	> made.txt
+	echo made >> order.txt
+	echo done > made.txt
+bad:
+	false
+after: bad
+	echo after >> order.txt
+EOF2
+
+# the report ends with timings
+TIMES='^run: [0-9.]+s elapsed|^run: critical path'
+
+# one at a time, ties go to the task written first
+check serial "0
+base
+left
+right
+all" "$TIMES" <<'EOF2'
+run -j 1 tasks all
+echo $?
+cat order.txt
+EOF2
+
+# in parallel only the ends of the diamond have a fixed place
+rm order.txt
+check parallel "0
+base
+all" "$TIMES" <<'EOF2'
+run -j 4 tasks all
+echo $?
+head -n 1 order.txt
+tail -n 1 order.txt
+EOF2
+
+rm order.txt
+check up_to_date "made" "$TIMES" <<'EOF2'
+run tasks made
+run tasks made
+cat order.txt
+EOF2
+
+check failed_dependency "run: bad failed with status 1
+1
+made" "$TIMES" <<'EOF2'
+run tasks after
+echo $?
+cat order.txt
+EOF2
+
+finish
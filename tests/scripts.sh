@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# msh -j N script...: scripts run concurrently in one process, each with its own cwd, variables, options
+# and stdout. The sleeps make the order of their lines fixed: a, then b, then a again...
+
+. "$(dirname "$0")/lib.sh"
+
+# concurrent NAME EXPECTED SCRIPT...: runs the scripts with msh -j and compares what they print
+concurrent() {
+	name=$1
+	expected=$2
+	shift 2
+	actual=$("$MSH" -j "$#" "$@" 2>&1)
+	if [ "$actual" != "$expected" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$name" "$expected" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+mkdir da db
+executable show.sh <<'EOF2'
+echo "$1 child A=$A B=$B $(pwd)"
+EOF2
+
+cat > a.msh <<'EOF2'
+cd da
+A=1
+export A
+echo a1 A=$A B=$B $PWD
+sleep 0.4
+echo a2 A=$A B=$B $PWD
+../show.sh a3
+X=$(sleep 0.4; echo captured)
+echo a4 X=$X
+EOF2
+
+cat > b.msh <<'EOF2'
+sleep 0.2
+cd db
+B=2
+export B
+set -o pipefail
+echo b1 A=$A B=$B $PWD
+sleep 0.4
+../show.sh b2
+false | true
+echo b3 $?
+EOF2
+
+concurrent state "a1 A=1 B= $WORK/da
+b1 A= B=2 $WORK/db
+a2 A=1 B= $WORK/da
+a3 child A=1 B= $WORK/da
+b2 child A= B=2 $WORK/db
+b3 1
+a4 X=captured" a.msh b.msh
+
+# exit inside $(...) ends its script; the other one still prints to the terminal and keeps its options
+cat > exits.msh <<'EOF2'
+X=$(set -o pipefail; echo lost; exit)
+echo not reached
+EOF2
+
+cat > goes_on.msh <<'EOF2'
+sleep 0.2
+false | true
+echo goes on $?
+EOF2
+
+concurrent exit "goes on 0" exits.msh goes_on.msh
+
+finish
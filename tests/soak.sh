@@ -0,0 +1,64 @@
+#!/bin/sh
+#
+# Soak harness: drives msh with millions of mixed commands and samples its memory while they run
+#
+# Usage: tests/soak.sh [path/to/msh] [commands] [seconds between samples]
+#
+# The commands cycle through builtins, pipelines, globs, $(...), redirections, loops, source and
+# background jobs, fed on stdin like an interactive session. Every sample prints VmRSS from
+# /proc/<pid>/status and, for an msh built with -DMSH_SOAK=ON, the last heap line it reported
+# (mallinfo2, every 10000 lines). That build aborts as soon as its heap grows from one window to the
+# next, which makes the harness exit with its status.
+
+MSH=$(realpath "${1:-./msh}")
+COMMANDS=${2:-10000000}
+INTERVAL=${3:-10}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+mkdir dir
+touch dir/a.txt dir/b.txt dir/c.log
+printf 'A=1\nB=2\n' > lib.msh
+
+awk -v n="$COMMANDS" 'BEGIN {
+	mix[m++] = "echo plain words"
+	mix[m++] = "X=value; export X; unset X"
+	mix[m++] = "cd dir; cd .."
+	mix[m++] = "set -o pipefail; set +o pipefail"
+	mix[m++] = "true && false || :"
+	mix[m++] = "echo a b c | cat | wc -c"
+	mix[m++] = "ls dir | grep -c txt"
+	mix[m++] = "echo dir/*.txt dir/?.log"
+	mix[m++] = "V=$(echo sub | cat); echo $V"
+	mix[m++] = "W=$(echo builtins only)"
+	mix[m++] = "echo out > f; echo more >> f; cat < f > g"
+	mix[m++] = "ls nope 2>&1 | cat"
+	mix[m++] = "cat nope 2> err.txt"
+	mix[m++] = "true &"
+	mix[m++] = "echo bg | cat &"
+	mix[m++] = "jobs"
+	mix[m++] = "for x in 1 2 3; do echo $x; done"
+	mix[m++] = "if true; then echo yes; else echo no; fi"
+	mix[m++] = "echo $? $PIPESTATUS"
+	mix[m++] = "source lib.msh"
+	for (i = 0; i < n; i++) print mix[i % m]
+	print "true"
+}' | "$MSH" > /dev/null 2> msh.err &
+pid=$!
+
+start=$(date +%s)
+echo "msh pid $pid, $COMMANDS commands"
+while kill -0 "$pid" 2> /dev/null; do
+	rss=$(awk '/^VmRSS/ { print $2 }' "/proc/$pid/status" 2> /dev/null)
+	heap=$(grep '^soak:' msh.err | tail -n 1)
+	[ -n "$rss" ] && printf '%6ss  VmRSS %8s KiB  %s\n' $(($(date +%s) - start)) "$rss" "$heap"
+	sleep "$INTERVAL"
+done
+wait "$pid"
+status=$?
+
+grep -v '^soak:' msh.err | sort | uniq -c | sort -rn | head -n 5
+grep '^soak:' msh.err | tail -n 2
+echo "msh exited with status $status after $(($(date +%s) - start))s"
+exit "$status"
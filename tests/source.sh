@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# source: runs a file in the current shell, stops at 64 nested files, and notices when a file it has
+# cached changes
+
+. "$(dirname "$0")/lib.sh"
+
+printf 'echo in $OUTER\nINNER=set\n' > vars.msh
+printf 'echo d >> depth\nsource self.msh\n' > self.msh
+printf 'echo d >> depth\n' > once.msh
+
+# variables go both ways between the shell and the sourced file
+check shared "in x
+set" <<'EOF2'
+OUTER=x
+source vars.msh
+echo $INNER
+EOF2
+
+# a file sourcing itself runs 64 times, then the innermost source fails and the rest goes on
+check depth "source: self.msh: nested too deeply
+after 1
+64
+again 0
+65" <<'EOF2'
+source self.msh
+echo after $?
+wc -l < depth
+source once.msh
+echo again $?
+wc -l < depth
+EOF2
+
+check missing "source: nope.msh: no such file or directory
+1" <<'EOF2'
+source nope.msh
+echo $?
+EOF2
+
+# a rewrite of the same size only changes the mtime (the sleep makes sure it does), and that's enough for
+# the cached parse not to be used
+check changed "one
+three
+two" <<'EOF2'
+echo echo one > f.msh
+source f.msh
+echo echo three > f.msh
+source f.msh
+sleep 0.1
+echo echo two > f.msh
+source f.msh
+EOF2
+
+finish
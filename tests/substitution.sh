@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# $(...): output captured with the trailing newlines removed, in-process for builtins and through a memfd
+# otherwise, and like a subshell neither way changes the shell's cwd, variables or options
+
+. "$(dirname "$0")/lib.sh"
+
+check output "hi
+there
+ext
+a b
+2" <<'EOF2'
+X=$(echo hi; echo there)
+echo $X
+echo $(/bin/echo ext)
+echo $(echo a) $(echo b | cat)
+echo $(echo $(echo 2))
+EOF2
+
+mkdir sub
+check cwd "/
+$WORK
+$WORK/sub
+$WORK
+$WORK" <<'EOF2'
+echo $(cd /; /bin/pwd)
+/bin/pwd
+echo $(cd sub; echo $PWD)
+echo $PWD
+X=$(cd /)
+/bin/pwd
+EOF2
+
+executable showe.sh <<'EOF2'
+echo ext=$E
+EOF2
+
+check variables "inner 1
+v=keep e= i=
+ext=" <<'EOF2'
+V=keep
+echo $(V=1; echo inner $V)
+X=$(V=1)
+Y=$(export E=2)
+Z=$(for I in a b; do echo $I; done)
+W=$(unset V)
+echo v=$V e=$E i=$I
+./showe.sh
+EOF2
+
+check options "0" <<'EOF2'
+X=$(set -o pipefail)
+false | true
+echo $?
+EOF2
+
+finish
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# timeout and $JOB_TIMEOUT: a job past its deadline gets SIGTERM and exits with 124 like timeout(1),
+# its stages report 143 (128 + SIGTERM), or 137 once a stage that ignores SIGTERM gets SIGKILL
+
+. "$(dirname "$0")/lib.sh"
+
+executable stubborn.sh <<'EOF2'
+trap '' TERM
+exec sleep 30
+EOF2
+
+check deadline "124 143
+124 143 143
+0
+1" <<'EOF2'
+timeout 0.2 sleep 10
+echo $? $PIPESTATUS
+timeout 0.2 sleep 10 | cat
+echo $? $PIPESTATUS
+timeout 5 true
+echo $?
+timeout 5 false
+echo $?
+EOF2
+
+check job_timeout "124 143
+0" <<'EOF2'
+JOB_TIMEOUT=0.2
+sleep 10
+echo $? $PIPESTATUS
+JOB_TIMEOUT=
+true
+echo $?
+EOF2
+
+check usage "timeout: usage: timeout DURATION pipeline
+1" <<'EOF2'
+timeout 1x true
+echo $?
+EOF2
+
+# SIGKILL comes TIMEOUT_GRACE (5) seconds after SIGTERM
+check grace "124 137" <<'EOF2'
+timeout 0.2 ./stubborn.sh
+echo $? $PIPESTATUS
+EOF2
+
+finish
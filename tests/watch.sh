@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# watch PATH... -- pipeline: runs the pipeline, then again after a write to a watched path, once per
+# burst of writes, cancelling the run still in flight; SIGINT ends it. msh runs in the background while
+# the test writes, with sleeps long enough for each run and for the 100 ms debounce.
+
+. "$(dirname "$0")/lib.sh"
+
+# watching NAME EXPECTED ACTIONS < SCRIPT: runs SCRIPT in the background, evaluates ACTIONS, then sends
+# SIGINT and compares what msh printed
+watching() {
+	cat > "$1.msh"
+	"$MSH" "$1.msh" > "$1.out" 2>&1 &
+	pid=$!
+	sleep 0.5
+	eval "$3"
+	sleep 0.5
+	kill -INT "$pid"
+	wait "$pid"
+	actual=$(cat "$1.out")
+	if [ "$actual" != "$2" ]; then
+		printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n' "$1" "$2" "$actual"
+		failures=$((failures + 1))
+	fi
+}
+
+executable slow.sh <<'EOF2'
+sleep 1
+cat f
+EOF2
+
+echo one > f
+# other files in the same directory don't count, three and four are one burst
+watching runs "one
+two
+four
+status 0" 'echo two > f; sleep 0.5; echo three > f; echo four > f; sleep 0.5; echo x > other' <<'EOF2'
+watch f -- cat f
+echo status $?
+EOF2
+
+# the write lands while the first run sleeps, which is cancelled
+echo one > f
+watching cancel "two
+status 0" 'echo two > f; sleep 1.5' <<'EOF2'
+watch f -- ./slow.sh
+echo status $?
+EOF2
+
+# a directory takes a change to anything in it
+mkdir d
+watching dir "0
+1" 'touch d/new' <<'EOF2'
+watch d -- ls d | wc -l
+EOF2
+
+check usage "watch: usage: watch PATH... -- pipeline
+watch: usage: watch PATH... -- pipeline
+1" <<'EOF2'
+watch f
+watch -- true
+echo $?
+EOF2
+
+finish